@@ -4,29 +4,154 @@ type 'a ancient
 
 type info = {
   i_size : int;
+  i_temp_size : int;
+  i_saved : int;
 }
 
-external mark_info : 'a -> 'a ancient * info = "ancient_mark_info"
+type layout = Depth_first | Breadth_first | Clustered
 
-let mark obj = fst (mark_info obj)
+(* Must match the MARK_* flags in ancient_c.c. *)
+let flags ?(intern = false) ?(hugepages = false) ~dedup ~layout ~align () =
+  (if dedup then 1 else 0) lor (if intern then 2 else 0) lor
+  (match layout with Depth_first -> 0 | Breadth_first -> 4 | Clustered -> 8)
+  lor (if align then 16 else 0) lor (if hugepages then 32 else 0)
+
+external mark_info_c : int -> 'a -> 'a ancient * info = "ancient_mark_info"
+
+let mark_info ?(dedup = false) ?(layout = Depth_first) ?(align = false)
+    ?hugepages obj =
+  mark_info_c (flags ~dedup ~layout ~align ?hugepages ()) obj
+
+let mark ?dedup ?layout ?align ?hugepages obj =
+  fst (mark_info ?dedup ?layout ?align ?hugepages obj)
+
+external mark_parallel_info : threads:int -> 'a -> 'a ancient * info
+  = "ancient_mark_parallel_info"
+
+let mark_parallel ~threads obj = fst (mark_parallel_info ~threads obj)
+
+type inc_mark
+
+type 'a mark_state = {
+  ms_obj : 'a;				(* Keeps the objects alive. *)
+  ms_inc : inc_mark;
+  ms_compactions : int;
+}
+
+external mark_start_c : 'a -> inc_mark = "ancient_mark_start"
+external mark_step_c : inc_mark -> int -> bool = "ancient_mark_step"
+external mark_abort_c : inc_mark -> unit = "ancient_mark_abort"
+external mark_finish_info_c : inc_mark -> 'a ancient * info
+  = "ancient_mark_finish_info"
+
+let compactions () = (Gc.quick_stat ()).Gc.compactions
+
+let mark_start obj =
+  Gc.minor ();
+  { ms_obj = obj; ms_inc = mark_start_c obj; ms_compactions = compactions () }
+
+let mark_abort st = mark_abort_c st.ms_inc
+
+(* The objects must not have moved since mark_start. *)
+let check_not_moved st =
+  if compactions () <> st.ms_compactions then (
+    mark_abort st;
+    failwith "Ancient.mark: heap compacted"
+  )
+
+let mark_step st work =
+  check_not_moved st;
+  mark_step_c st.ms_inc work
+
+let mark_step_for st secs =
+  check_not_moved st;
+  let t1 = Unix.gettimeofday () +. secs in
+  let rec loop () =
+    if mark_step_c st.ms_inc 10_000 then true
+    else if Unix.gettimeofday () >= t1 then false
+    else loop ()
+  in
+  loop ()
+
+let mark_finish_info st =
+  check_not_moved st;
+  mark_finish_info_c st.ms_inc
+
+let mark_finish st = fst (mark_finish_info st)
 
 external follow : 'a ancient -> 'a = "ancient_follow"
 
 external delete : 'a ancient -> unit = "ancient_delete"
 
+external mark_many_c : 'a array -> 'a ancient array = "ancient_mark_many"
+
+let mark_many roots =
+  if Array.length roots = 0 then [||] else mark_many_c roots
+
+external delete_many : 'a ancient array -> unit = "ancient_delete_many"
+
 external is_ancient : 'a -> bool = "ancient_is_ancient"
 
 external address_of : 'a -> nativeint = "ancient_address_of"
 
 type md
 
-external attach : Unix.file_descr -> nativeint -> md = "ancient_attach"
+external attach_c : bool -> bool -> Unix.file_descr -> nativeint -> md
+  = "ancient_attach"
+
+let attach ?(hugepages = false) ?(relocate = false) fd baseaddr =
+  attach_c hugepages relocate fd baseaddr
+
+external attach_readonly_c : bool -> Unix.file_descr -> md
+  = "ancient_attach_readonly"
+
+let attach_readonly ?(relocate = false) fd = attach_readonly_c relocate fd
+
+type relocation = {
+  r_old_base : nativeint;
+  r_new_base : nativeint;
+  r_pointers : int;
+  r_time : float;
+}
+
+external relocation : md -> relocation option = "ancient_relocation"
+
+external warmup_c : int -> (int -> int -> unit) option -> md -> unit
+  = "ancient_warmup"
+
+let warmup ?(threads = 4) ?progress md =
+  let t0 = Unix.gettimeofday () in
+  warmup_c threads progress md;
+  Unix.gettimeofday () -. t0
+
+external set_growth : min:int -> percent:int -> unit = "ancient_set_growth"
+
+external set_reserve : int -> unit = "ancient_set_reserve"
 
 external detach : md -> unit = "ancient_detach"
 
-external share_info : md -> int -> 'a -> 'a ancient * info
+external share_info_c : int -> md -> int -> 'a -> 'a ancient * info
   = "ancient_share_info"
 
-let share md key obj = fst (share_info md key obj)
+let share_info ?(dedup = false) ?intern ?(layout = Depth_first)
+    ?(align = false) md key obj =
+  share_info_c (flags ~dedup ?intern ~layout ~align ()) md key obj
+
+let share ?dedup ?intern ?layout ?align md key obj =
+  fst (share_info ?dedup ?intern ?layout ?align md key obj)
+
+external share_parallel_info : threads:int -> md -> int -> 'a ->
+  'a ancient * info = "ancient_share_parallel_info"
+
+let share_parallel ~threads md key obj =
+  fst (share_parallel_info ~threads md key obj)
+
+external share_many_c : md -> int -> 'a array -> 'a ancient array
+  = "ancient_share_many"
+
+let share_many md key roots =
+  if Array.length roots = 0 then [||] else share_many_c md key roots
 
 external get : md -> int -> 'a ancient = "ancient_get"
+
+external release : md -> unit = "ancient_release"
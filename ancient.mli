@@ -2,16 +2,55 @@
 
 type 'a ancient
 
-val mark : 'a -> 'a ancient
+type layout =
+  | Depth_first				(** Depth first, pre-order. *)
+  | Breadth_first			(** Breadth first. *)
+  | Clustered				(** Subtrees clustered in pages. *)
+  (** Order of the objects in the copy made by {!Ancient.mark}. *)
+
+val mark : ?dedup:bool -> ?layout:layout -> ?align:bool ->
+  ?hugepages:bool -> 'a -> 'a ancient
   (** [mark obj] copies [obj] and all objects referenced
     * by [obj] out of the OCaml heap.  It returns the proxy
     * for [obj].
     *
     * The copy of [obj] accessed through the proxy MUST NOT be mutated.
     *
+    * With [~dedup:true], leaves which are structurally equal are
+    * copied only once: strings, floats, float arrays, and blocks
+    * which contain only immediate values, such as tuples of
+    * integers.  Copies of leaves which were physically different may
+    * therefore become physically equal.  This takes some more time
+    * and temporary memory, but can save a lot of space when the same
+    * values repeat.  See the [i_saved] field of {!Ancient.info}.
+    *
+    * [~layout] chooses the order in which the objects are laid out
+    * in the copy, which matters for the locality of later accesses.
+    * The default, [Depth_first], suits lists and structures which
+    * are walked in order.  [Breadth_first] keeps the top levels of
+    * trees together.  [Clustered] lays out each subtree breadth
+    * first in 4 KB clusters, so that a lookup from the root to a leaf
+    * in a large trie or map touches few pages.  [Breadth_first] and
+    * [Clustered] need temporary memory for all the objects of a
+    * level of the tree.
+    *
+    * With [~align:true], blocks of 16 words or more (except [obj]
+    * itself) are placed so that their fields start on a 64 byte
+    * cache line.  The padding costs up to 56 bytes per block.
+    *
+    * With [~hugepages:true], a copy of 2 MB or more is aligned on
+    * 2 MB and the kernel is asked to back it with transparent huge
+    * pages (see [madvise(2)], [MADV_HUGEPAGE]).  This can speed up
+    * random accesses to a large copy, by reducing TLB misses.  It
+    * has no effect if transparent huge pages are disabled.
+    *
     * If [obj] represents a large object, then it is a good
     * idea to call {!Gc.compact} after marking to recover the
     * OCaml heap memory.
+    *
+    * [mark] keeps no global state, so different domains may mark
+    * at the same time, provided the objects they mark do not
+    * share any subnodes.
     *)
 
 val follow : 'a ancient -> 'a
@@ -26,6 +65,28 @@ val delete : 'a ancient -> unit
     * @raise Invalid_argument "deleted" if the object has been deleted.
     *
     * Forgetting to delete an ancient object results in a memory leak.
+    *
+    * @raise Invalid_argument if [obj] is part of a batch made by
+    * {!Ancient.mark_many}.  Use {!Ancient.delete_many} instead.
+    *)
+
+val mark_many : 'a array -> 'a ancient array
+  (** [mark_many roots] is like calling {!Ancient.mark} on each of
+    * the [roots], but they are all copied together into a single
+    * allocation, and objects shared between them are copied once
+    * and stay shared.  It returns the proxies for the [roots], in
+    * the same order.
+    *
+    * The proxies form a batch which can only be deleted as a whole,
+    * using {!Ancient.delete_many}.
+    *)
+
+val delete_many : 'a ancient array -> unit
+  (** [delete_many proxies] deletes the batch made by
+    * {!Ancient.mark_many}.  [proxies] must be all the proxies
+    * returned by that call.
+    *
+    * @raise Invalid_argument "deleted" if the batch has been deleted.
     *)
 
 val is_ancient : 'a -> bool
@@ -43,7 +104,8 @@ val address_of : 'a -> nativeint
 type md
   (** Memory descriptor handle. *)
 
-val attach : Unix.file_descr -> nativeint -> md
+val attach : ?hugepages:bool -> ?relocate:bool ->
+  Unix.file_descr -> nativeint -> md
   (** [attach fd baseaddr] attaches to a new or existing file
     * which may contain shared objects.
     *
@@ -55,23 +117,121 @@ val attach : Unix.file_descr -> nativeint -> md
     *
     * For new files, [baseaddr] specifies the virtual address to
     * map the file.  Specifying [Nativeint.zero] ([0n]) here lets [mmap(2)]
-    * choose this, but on some platforms (notably Linux/AMD64)
-    * [mmap] chooses very unwisely, tending to map the memory
-    * just before [libc] with hardly any headroom to grow.  If
-    * you encounter this sort of problem (usually a segfault or
-    * illegal instruction inside libc), then look at [/proc/PID/maps]
-    * and choose a more suitable address.
+    * choose this.  Either way, a range of address space (256 GB by
+    * default, see {!Ancient.set_reserve}) is reserved for the file
+    * to grow into, so [0n] is fine on 64-bit platforms.  If that range
+    * isn't free at [baseaddr], the file grows only as long as nothing
+    * else is mapped after it; [share] then raises [Sys_error].
     *
     * If the file was created previously, then the [baseaddr] is
     * ignored.  The underlying [mmalloc] library will map the
     * file in at the same place as before.
+    *
+    * With [~hugepages:true], the file grows in steps of 2 MB and
+    * the kernel is asked to map it with transparent huge pages.  The
+    * kernel only does so for files on a [tmpfs] mounted with the
+    * [huge=] option.  Files on [hugetlbfs] are always mapped with
+    * huge pages, whether or not [~hugepages] is given.  In both cases
+    * [baseaddr] should be aligned on the huge page size.  This
+    * setting is not stored in the file.
+    *
+    * With [~relocate:true], an existing file is mapped at the same
+    * place as before only if that place is free.  Otherwise it is
+    * mapped at [baseaddr], or anywhere if that is taken too, and all
+    * the pointers in it are relocated.  The new address is written
+    * to the file, so no other process may have the file attached at
+    * the time.  See {!Ancient.relocation}.
+    *)
+
+val attach_readonly : ?relocate:bool -> Unix.file_descr -> md
+  (** [attach_readonly fd] attaches to an existing file, created by
+    * {!Ancient.attach} and {!Ancient.share}, only to read the objects
+    * in it with {!Ancient.get} and {!Ancient.follow}.  [fd] may be
+    * opened with just [O_RDONLY].
+    *
+    * The file is mapped read-only at the same place as when it was
+    * created, and the allocator in it is not touched, so attaching is
+    * quick and the reader can't dirty any pages.  Objects shared after
+    * the file was attached are mapped in by {!Ancient.get} as the file
+    * grows, so readers don't need to attach again.
+    *
+    * {!Ancient.share} and its variants raise [Invalid_argument] if
+    * they are called on the result.
+    *
+    * With [~relocate:true], if the place where the file was created
+    * is taken, the file is mapped anywhere else, privately, and
+    * relocated in memory.  The pages which hold pointers are then
+    * copied, not shared with other processes.  The file is not
+    * modified.
+    *
+    * @raise Failure if the file is empty or not an [mmalloc] file.
+    *)
+
+val warmup : ?threads:int -> ?progress:(int -> int -> unit) -> md -> float
+  (** [warmup md] reads the whole of the file attached as [md] into
+    * memory and maps it, so that later accesses to the objects in it
+    * don't wait for page faults.  This is useful just after attaching
+    * a large file whose pages are not yet in the page cache.
+    *
+    * The work is split between [threads] native threads (default 4),
+    * so that several reads from the disk are in flight at once.
+    * [progress done total] is called from time to time in the calling
+    * thread with the number of bytes done so far and the size of the
+    * mapping, and once more at the end.  If it raises an exception,
+    * the warm-up stops and the exception is passed on.
+    *
+    * Returns the time it took, in seconds.
+    *
+    * @raise Invalid_argument if [threads] is not between 1 and 256.
+    *)
+
+type relocation = {
+  r_old_base : nativeint;		(** Address the file was mapped at. *)
+  r_new_base : nativeint;		(** Address it is mapped at now. *)
+  r_pointers : int;			(** Number of pointers relocated. *)
+  r_time : float;			(** Time taken to attach, seconds. *)
+}
+
+val relocation : md -> relocation option
+  (** [relocation md] returns how the file attached as [md] was
+    * relocated, or [None] if it was mapped back where it was (see
+    * [~relocate] in {!Ancient.attach}).
+    *
+    * Relocation walks all the objects stored in the file.  Files
+    * written by older versions of this library don't record where
+    * their objects are, so their objects are found by following the
+    * pointers from each key, which is slower.
+    *)
+
+val set_growth : min:int -> percent:int -> unit
+  (** [set_growth ~min ~percent] sets how much a shared file grows
+    * when an object doesn't fit in it any more: by at least [min]
+    * bytes, or by [percent] percent of the current size, whichever
+    * is more.  The default is 1 MB or 25%, so a file that keeps
+    * growing is remapped only a few times.  The new space is
+    * allocated on the disk with [posix_fallocate(3)] before it is
+    * used.  The setting applies to all the files attached by the
+    * process.
+    *
+    * @raise Invalid_argument if [min] or [percent] is negative.
+    *)
+
+val set_reserve : int -> unit
+  (** [set_reserve size] sets how much address space is reserved for
+    * each file attached read/write from now on.  A file can grow that
+    * far without running into other mappings, and no memory or disk
+    * space is used until it does.  The default is 256 GB on 64-bit
+    * platforms.  [0] turns the reservation off.
+    *
+    * @raise Invalid_argument if [size] is negative.
     *)
 
 val detach : md -> unit
   (** [detach md] detaches from an existing file, and closes it.
     *)
 
-val share : md -> int -> 'a -> 'a ancient
+val share : ?dedup:bool -> ?intern:bool -> ?layout:layout -> ?align:bool ->
+  md -> int -> 'a -> 'a ancient
   (** [share md key obj] does the same as {!Ancient.mark} except
     * that instead of copying the object into local memory, it
     * writes it into memory which is backed by the attached file.
@@ -85,17 +245,51 @@ val share : md -> int -> 'a -> 'a ancient
     * If you do not wish to use this feature, just pass [0]
     * as the key.
     *
+    * With [~intern:true], strings are looked up in a table kept
+    * in the file, and each different string is stored only once,
+    * whichever key and whichever call to [share] it comes from.
+    * Interned strings are never freed, even when all the objects
+    * using them have been overwritten.  The bytes of strings which
+    * were already in the table are counted in the [i_saved] field of
+    * {!Ancient.info}.
+    *
     * Do not call {!Ancient.delete} on a mapping created like this.
     * Instead, call {!Ancient.detach} and, if necessary, delete the
     * underlying file.
     *
-    * Caution when sharing files/objects between processes:
-    * The underlying [mmalloc] library does not do any sort of
-    * locking, so all calls to [share] must ensure that they have
-    * exclusive access to the underlying file while in progress.
-    * (Other processes should not even call {!Ancient.get} while
-    * this is happening, but it seems safe to be just reading an
-    * ancient object from the file).
+    * Several processes (or threads) may call [share] on the same
+    * file at the same time.  The file holds a lock, which each
+    * allocation of whole pages and each update of the keys takes in
+    * turn, so large objects are copied in parallel.  Small blocks come
+    * from one of 16 arenas in the file, which each writing thread
+    * claims for itself, so writers don't wait for each other to get
+    * them, and each thread keeps a few free ones at hand, which a
+    * process that dies without detaching the file loses for good.
+    * Sharing with [~intern:true] holds the lock for the whole copy.  When two writers share
+    * under the same key at once, the last one to finish wins.  If a
+    * process dies while holding the lock, the next one takes it
+    * over.  Files created by older versions of this library have no
+    * lock and still need exclusive access while [share] runs.
+    *
+    * Readers never wait for writers.  [share] copies the new object
+    * before it replaces the old one under [key], so {!Ancient.get}
+    * returns one or the other, whole.  The old object is freed only
+    * once every process which may still be using it has called
+    * {!Ancient.release} or {!Ancient.detach}, so the file needs room
+    * for both in the meantime.
+    *
+    * @raise Sys_error if the file can't grow, for example because
+    * the disk is full.  Objects shared before are not affected.
+    *)
+
+val share_many : md -> int -> 'a array -> 'a ancient array
+  (** [share_many md key roots] does the same as {!Ancient.mark_many}
+    * except that the batch is written into the attached file, like
+    * {!Ancient.share}.
+    *
+    * The batch is stored under [key] as a single object, the array
+    * of [roots], which {!Ancient.get} returns as an
+    * ['a array ancient].  An empty batch is not stored at all.
     *)
 
 val get : md -> int -> 'a ancient
@@ -110,20 +304,127 @@ val get : md -> int -> 'a ancient
     * or undefined behaviour.  Note that the returned object has
     * type [sometype ancient], not just [sometype].
     *
+    * The objects returned by [get], and those they point to, stay
+    * valid until {!Ancient.release} or {!Ancient.detach}, even if a
+    * writer replaces them with {!Ancient.share} in the meantime.
+    *
     * @raise Not_found if no object is associated with the key.
+    * @raise Failure if too many processes are reading the file.
+    *)
+
+val release : md -> unit
+  (** [release md] tells writers that the objects this process got
+    * from [md] with {!Ancient.get} are not used any more, so that
+    * those which were replaced since can be freed.  Objects got
+    * before must not be followed after this; call {!Ancient.get}
+    * again to see the current ones.
+    *)
+
+(** {6 Parallel marking} *)
+
+val mark_parallel : threads:int -> 'a -> 'a ancient
+  (** [mark_parallel ~threads obj] does the same as {!Ancient.mark},
+    * but the object graph is traversed and copied by [threads]
+    * native threads.  This is worthwhile for very large graphs
+    * which are not just long lists.
+    *
+    * The objects visited so far are tracked in a table on the side
+    * instead of in the object headers, so this needs a lot more
+    * temporary memory than {!Ancient.mark}: roughly 40 bytes for
+    * each object.  Objects end up grouped by thread in the copy,
+    * not in depth-first order.
+    *
+    * @raise Invalid_argument if [threads] is not between 1 and 256.
+    *)
+
+val share_parallel : threads:int -> md -> int -> 'a -> 'a ancient
+  (** Same as {!Ancient.share}, using [threads] threads like
+    * {!Ancient.mark_parallel}.  Only the calling thread allocates
+    * from the file.
+    *)
+
+(** {6 Incremental marking} *)
+
+type 'a mark_state
+  (** A mark in progress. *)
+
+val mark_start : 'a -> 'a mark_state
+  (** [mark_start obj] starts marking [obj], like {!Ancient.mark},
+    * but does not copy anything yet.  The work is done by
+    * {!Ancient.mark_step} or {!Ancient.mark_step_for}, and the result
+    * is obtained with {!Ancient.mark_finish}.  Other code can run
+    * between the steps, so long pauses are avoided.
+    *
+    * The objects are not modified while marking, but they are
+    * remembered by address in a table on the side, which needs about
+    * 40 bytes for each object.  Therefore:
+    * - [obj] and the objects it references MUST NOT be mutated until
+    *   the mark is finished, or the copy will be inconsistent.
+    * - The minor heap is emptied by [mark_start], and if the heap is
+    *   compacted before the mark is finished (see {!Gc.compact}), the
+    *   mark is aborted and the next call raises [Failure].
+    *
+    * A mark which is started must be either finished or aborted with
+    * {!Ancient.mark_abort}, otherwise the memory it uses is leaked.
+    *)
+
+val mark_step : 'a mark_state -> int -> bool
+  (** [mark_step st work] does up to [work] units of work on the
+    * mark, each unit being to scan or to copy a single object.
+    * Returns [true] when the mark is complete and can be finished.
+    *)
+
+val mark_step_for : 'a mark_state -> float -> bool
+  (** [mark_step_for st secs] works on the mark for about [secs]
+    * seconds.  Returns [true] when the mark is complete and can be
+    * finished.
+    *)
+
+val mark_finish : 'a mark_state -> 'a ancient
+  (** [mark_finish st] completes the mark, doing any work which is
+    * left in one go, and returns the proxy.
+    *
+    * @raise Invalid_argument "finished" if the mark has already been
+    * finished or aborted.
+    *)
+
+val mark_abort : 'a mark_state -> unit
+  (** [mark_abort st] cancels the mark and frees the memory it uses.
+    *
+    * @raise Invalid_argument "finished" if the mark has already been
+    * finished or aborted.
     *)
 
 (** {6 Additional information} *)
 
 type info = {
   i_size : int;				(** Allocated size, bytes. *)
+  i_temp_size : int;			(** Peak temporary memory used
+					    while marking, bytes. *)
+  i_saved : int;			(** Bytes saved by [~dedup]
+					    and [~intern]. *)
 }
   (** Extra information fields.  See {!Ancient.mark_info} and
     * {!Ancient.share_info}.
     *)
 
-val mark_info : 'a -> 'a ancient * info
+val mark_info : ?dedup:bool -> ?layout:layout -> ?align:bool ->
+  ?hugepages:bool -> 'a -> 'a ancient * info
   (** Same as {!Ancient.mark}, but also returns some extra information. *)
 
-val share_info : md -> int -> 'a -> 'a ancient * info
+val share_info : ?dedup:bool -> ?intern:bool -> ?layout:layout ->
+  ?align:bool -> md -> int -> 'a -> 'a ancient * info
   (** Same as {!Ancient.share}, but also returns some extra information. *)
+
+val mark_finish_info : 'a mark_state -> 'a ancient * info
+  (** Same as {!Ancient.mark_finish}, but also returns some extra
+    * information. *)
+
+val mark_parallel_info : threads:int -> 'a -> 'a ancient * info
+  (** Same as {!Ancient.mark_parallel}, but also returns some extra
+    * information. *)
+
+val share_parallel_info : threads:int -> md -> int -> 'a ->
+  'a ancient * info
+  (** Same as {!Ancient.share_parallel}, but also returns some extra
+    * information. *)
@@ -2,7 +2,17 @@
  */
 
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define CAML_INTERNALS
 
@@ -11,6 +21,8 @@
 #include <caml/alloc.h>
 #include <caml/mlvalues.h>
 #include <caml/fail.h>
+#include <caml/callback.h>
+#include <caml/sys.h>
 #include <caml/address_class.h>
 
 #if OCAML_VERSION_MAJOR == 5
@@ -76,17 +88,18 @@ area_append (area *a, const void *obj, size_t size)
   return 0;
 }
 
-static inline void
-area_shrink (area *a)
+// Allocate exactly [size] bytes for an area which is still empty.
+static inline int
+area_reserve (area *a, size_t size)
 {
-  if (a->n != a->size) {
-    a->size = a->n;
-    a->ptr =
-      a->realloc
-      ? a->realloc (a->data, a->ptr, a->size)
-      : realloc (a->ptr, a->size);
-    assert (a->ptr); // Getting smaller, so shouldn't really fail.
-  }
+  void *ptr =
+    a->realloc
+    ? a->realloc (a->data, a->ptr, size)
+    : realloc (a->ptr, size);
+  if (ptr == 0) return -1; // Out of memory.
+  a->ptr = ptr;
+  a->size = size;
+  return 0;
 }
 
 static inline void
@@ -98,342 +111,2244 @@ area_free (area *a)
   a->size = 0;
 }
 
-struct restore_item {
-  header_t *header_ptr;
-  value field_zero;
-};
-
-/* When a block is visited, we set its tag to Double_tag, and its
- * wosize to 10. This header is impossible to generate in a classical
- * OCaml runtime (idea by Damien Doligez)
+/* When a block is visited, we set its tag to Double_tag, and the top
+ * bit of its wosize.  This header is impossible to generate in a
+ * classical OCaml runtime, where Double_tag blocks always have a
+ * wosize of Double_wosize (idea by Damien Doligez).
+ *
+ * The rest of the wosize remembers what we need to know about the
+ * block, so that we don't have to keep a list of the objects that we
+ * modified on the side:
+ * - While sizing (first pass), it keeps the original wosize and tag.
+ *   The other bits of the header (the color) are left alone, so the
+ *   original header can be recovered from the visited one.
+ * - Once the block has been copied (second pass), the COPIED_BIT is
+ *   set and it keeps the offset of the copy.  The copy starts with
+ *   the original header.
+ * The fields of the block are never modified.
  */
 
-#define ATOM_OFFSET 10
-static header_t visited = Make_header(10, Double_tag, 0);
-static value atoms[256];
+#define VISITED_BIT ((Max_wosize >> 1) + 1)
+#define COPIED_BIT (VISITED_BIT >> 1)
+#define MAX_VISITED_WOSIZE ((COPIED_BIT - 1) >> 8)
+#define HEADER_WOSIZE_TAG Make_header (Max_wosize, 0xFF, 0)
+
+static inline int
+is_visited (header_t hd)
+{
+  return Tag_hd (hd) == Double_tag && (Wosize_hd (hd) & VISITED_BIT);
+}
+
+static inline int
+is_copied (header_t hd)
+{
+  return is_visited (hd) && (Wosize_hd (hd) & COPIED_BIT);
+}
+
+static inline header_t
+visited_header (header_t hd)
+{
+  mlsize_t enc = VISITED_BIT | (Wosize_hd (hd) << 8) | Tag_hd (hd);
+  return (hd & ~HEADER_WOSIZE_TAG) | Make_header (enc, Double_tag, 0);
+}
+
+static inline header_t
+original_header (header_t hd)
+{
+  mlsize_t enc = Wosize_hd (hd) & (COPIED_BIT - 1);
+  return (hd & ~HEADER_WOSIZE_TAG) | Make_header (enc >> 8, enc & 0xFF, 0);
+}
+
+static inline header_t
+copied_header (size_t offset)
+{
+  return Make_header (VISITED_BIT | COPIED_BIT | Wsize_bsize (offset),
+		      Double_tag, 0);
+}
+
+static inline size_t
+copied_offset (header_t hd)
+{
+  return Bsize_wsize (Wosize_hd (hd) & (COPIED_BIT - 1));
+}
 
 // The general plan here:
 //
-// 1. Starting at [obj], copy it to our out-of-heap memory area
-// defined by [ptr].
-// 2. Recursively visit subnodes of [obj] and do the same.
-// 3. As we copy each object, we avoid circularity by setting that
-// object's header to a special 'visited' value.  However since these
-// are objects in the Caml heap we have to restore the original
-// headers at the end, which is the purpose of the [restore] area.
-// 4. We use realloc to allocate the memory for the copy, but because
-// the memory can move around, we cannot store absolute pointers.
-// Instead we store offsets and fix them up later.  This is the
-// purpose of the [fixups] area.
+// 1. Starting at [obj], visit [obj] and all its subnodes, to work out
+// how large the out-of-heap memory area has to be.  Instead of
+// recursing we keep an explicit stack of partially scanned objects
+// (the [stack] area) on the C heap, so that marking deep structures
+// such as long lists does not overflow the native stack.
+// 2. As we visit each object, we avoid circularity by setting that
+// object's header to a special 'visited' value (see above).
+// 3. Once the final size is known, we allocate the out-of-heap area
+// in one go, and walk the graph again to copy the objects there.
+// Since the area never moves, pointers between the copies can be
+// stored as absolute pointers straight away.
+// 4. Finally we walk the graph a third time to restore the original
+// headers in the Caml heap from the copies.
 //
-// XXX Large, deeply recursive structures cause a stack overflow.
-// Temporary solution: 'ulimit -s unlimited'.  This function should
-// be replaced with something iterative.
+// Apart from the copy itself, the only memory needed is the stack.
+//
+// All the state of a mark in progress is kept in a [struct mark_ctx]
+// which is passed to every function, so marks of independent graphs
+// can run concurrently, for example in different domains.  (Marking
+// graphs which share objects at the same time is not possible, since
+// the visited headers live in the shared objects.)
+
+// Zero-sized blocks (atoms) have no fields, so they are not marked as
+// visited.  Instead they are shared through the [atoms] table.
+#define ATOM_OFFSET 10
+
+// Flags for mark, see Ancient.mark and Ancient.share.
+#define MARK_DEDUP 1
+#define MARK_INTERN 2
+#define MARK_LAYOUT 12		// Mask of the layout bits:
+#define MARK_LAYOUT_DFS 0	// depth first, pre-order,
+#define MARK_LAYOUT_BFS 4	// breadth first,
+#define MARK_LAYOUT_CLUSTERED 8 // breadth first within clusters.
+#define MARK_ALIGN 16
+#define MARK_HUGEPAGES 32	// Ancient.mark only, see my_realloc_huge.
+
+// With MARK_ALIGN, the fields of blocks of at least this many words
+// start on a cache line.
+#define CACHE_LINE 64
+#define ALIGN_MIN_WOSIZE 16
+
+// Size of the clusters of MARK_LAYOUT_CLUSTERED, bytes.
+#define CLUSTER_SIZE 4096
+
+// Hash table used by the dedup mode, see dedup_leaf.
+struct dedup_slot {
+  value obj;			// Object in the Caml heap, or 0 if free.
+  value canon;			// The object it is a duplicate of.
+  uintnat hash;
+};
+
+struct dedup_table {
+  struct dedup_slot *slots;
+  size_t mask;			// Number of slots - 1, or 0 if none.
+  size_t n;			// Number of objects.
+};
+
+struct mark_ctx {
+  area ptr;			// The out of heap area.
+  area stack;			// Objects to be scanned, shared by all passes.
+  size_t size;			// Size of the out of heap area (first pass).
+  value atoms[256];		// Atoms seen, or offset of their copy
+				// + ATOM_OFFSET, indexed by tag.
+  int flags;			// MARK_* flags.
+  struct dedup_table leaves;	// Leaves which are copied, by contents.
+  struct dedup_table aliases;	// Leaves which are not, by address.
+  size_t saved;			// Size of the leaves which are not copied.
+  struct intern_table *intern;	// Intern table of the file, if MARK_INTERN.
+  area queue;			// Objects to be scanned, second pass, BFS.
+  size_t queue_head;		// First object in the queue.
+  area pending;			// Roots of the next clusters.
+  size_t cluster_start;		// Offset of the current cluster.
+  int error;			// Out of memory in the second pass.
+};
+
+static void
+mark_ctx_init (struct mark_ctx *ctx, int flags,
+	       void *(*realloc)(void *data, void *ptr, size_t size),
+	       void (*free)(void *data, void *ptr),
+	       void *data)
+{
+  area_init_custom (&ctx->ptr, realloc, free, data);
+  area_init (&ctx->stack);
+  ctx->size = 0;
+  memset (ctx->atoms, 0, sizeof ctx->atoms);
+  ctx->flags = flags;
+  memset (&ctx->leaves, 0, sizeof ctx->leaves);
+  memset (&ctx->aliases, 0, sizeof ctx->aliases);
+  ctx->saved = 0;
+  ctx->intern = 0;
+  area_init (&ctx->queue);
+  ctx->queue_head = 0;
+  area_init (&ctx->pending);
+  ctx->cluster_start = 0;
+  ctx->error = 0;
+}
+
+static inline int
+aligned_block (struct mark_ctx *ctx, mlsize_t wosize)
+{
+  return (ctx->flags & MARK_ALIGN) && wosize >= ALIGN_MIN_WOSIZE;
+}
+
+/* Dedup mode.
+ *
+ * In this mode, leaves which have the same contents are copied only
+ * once.  Leaves are strings, floats, float arrays and ordinary blocks
+ * which don't point into the Caml heap, such as tuples of integers.
+ *
+ * The first leaf of each kind seen in the first pass is visited as
+ * usual, and added to the [leaves] table.  The others (the aliases)
+ * are left alone, and only added to the [aliases] table, along with
+ * the leaf they duplicate.  In the second pass, unvisited blocks which
+ * are not atoms are aliases, and the copy of their leaf is used.
+ *
+ * Leaves are never pushed on the stack in this mode, in any pass, so
+ * the second pass still needs no more stack than the first one even
+ * though it copies a leaf early when it meets one of its aliases.
+ */
+
+static int
+is_leaf (value obj, header_t hd)
+{
+  mlsize_t i, wosize = Wosize_hd (hd);
+  tag_t tag = Tag_hd (hd);
+
+  if (tag == String_tag || tag == Double_tag || tag == Double_array_tag)
+    return 1;
+  if (tag >= Lazy_tag)		// Not ordinary blocks.
+    return 0;
+#ifdef Cont_tag
+  if (tag == Cont_tag)
+    return 0;
+#endif
+  for (i = 0; i < wosize; ++i) {
+    value field = Field (obj, i);
+    if (Is_block (field) && Is_in_value_area (field))
+      return 0;
+  }
+  return 1;
+}
+
+static inline int
+dedup_skip_push (struct mark_ctx *ctx, value obj, header_t hd)
+{
+  return (ctx->flags & MARK_DEDUP) && is_leaf (obj, hd);
+}
+
+static uintnat
+hash_contents (value obj, header_t hd)
+{
+  mlsize_t i, wosize = Wosize_hd (hd);
+  uint64_t h = (uint64_t) (wosize << 8 | Tag_hd (hd)) ^ 0xcbf29ce484222325ULL;
+
+  for (i = 0; i < wosize; ++i)
+    h = (h ^ (uint64_t) Field (obj, i)) * 0x100000001b3ULL;
+  return h ^ (h >> 32);
+}
+
+static inline uintnat
+hash_address (value obj)
+{
+  uint64_t h = ((uint64_t) obj >> 3) * 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 32);
+}
+
+// [canon] has been visited, [obj] hasn't.
+static int
+same_contents (value canon, value obj)
+{
+  header_t hd1 = original_header (Hd_val (canon)), hd2 = Hd_val (obj);
+
+  return Wosize_hd (hd1) == Wosize_hd (hd2) && Tag_hd (hd1) == Tag_hd (hd2)
+    && memcmp ((void *) canon, (void *) obj, Bsize_wsize (Wosize_hd (hd2))) == 0;
+}
+
+static struct dedup_slot *
+dedup_find (struct dedup_table *t, uintnat hash, value obj, int by_contents)
+{
+  size_t i = hash & t->mask;
+
+  for (;; i = (i + 1) & t->mask) {
+    struct dedup_slot *slot = &t->slots[i];
+    if (slot->obj == 0)
+      return slot;
+    if (by_contents
+	? slot->hash == hash && same_contents (slot->obj, obj)
+	: slot->obj == obj)
+      return slot;
+  }
+}
+
+// Make room for one more object.
+static int
+dedup_reserve (struct dedup_table *t)
+{
+  struct dedup_slot *old = t->slots;
+  size_t i, old_nr_slots = t->mask == 0 ? 0 : t->mask + 1;
+  size_t nr_slots = old_nr_slots == 0 ? 256 : old_nr_slots * 2;
+
+  if ((t->n + 1) * 2 <= old_nr_slots)
+    return 0;
+
+  t->slots = calloc (nr_slots, sizeof (struct dedup_slot));
+  if (t->slots == 0) {
+    t->slots = old;
+    return -1;
+  }
+  t->mask = nr_slots - 1;
+  for (i = 0; i < old_nr_slots; ++i)
+    if (old[i].obj != 0) {
+      // The objects are all different, no need to compare them.
+      size_t j = old[i].hash & t->mask;
+      while (t->slots[j].obj != 0)
+	j = (j + 1) & t->mask;
+      t->slots[j] = old[i];
+    }
+  free (old);
+  return 0;
+}
+
+static inline size_t
+dedup_table_size (struct dedup_table *t)
+{
+  return t->mask == 0 ? 0 : (t->mask + 1) * sizeof (struct dedup_slot);
+}
+
+static void
+dedup_free (struct mark_ctx *ctx)
+{
+  free (ctx->leaves.slots);
+  free (ctx->aliases.slots);
+  memset (&ctx->leaves, 0, sizeof ctx->leaves);
+  memset (&ctx->aliases, 0, sizeof ctx->aliases);
+}
+
+// First pass: look up the unvisited leaf [obj].  Returns 1 if it is an
+// alias, 0 if it must be visited, or -1 if we ran out of memory.
+static int
+dedup_leaf (struct mark_ctx *ctx, value obj, header_t hd)
+{
+  uintnat address_hash = hash_address (obj);
+  uintnat hash;
+  struct dedup_slot *slot;
+
+  if (ctx->aliases.n > 0 &&
+      dedup_find (&ctx->aliases, address_hash, obj, 0)->obj != 0)
+    return 1;
+
+  if (dedup_reserve (&ctx->leaves) == -1 ||
+      dedup_reserve (&ctx->aliases) == -1)
+    return -1;
+
+  hash = hash_contents (obj, hd);
+  slot = dedup_find (&ctx->leaves, hash, obj, 1);
+  if (slot->obj == 0) {
+    slot->obj = slot->canon = obj;
+    slot->hash = hash;
+    ctx->leaves.n++;
+    return 0;
+  }
+
+  value canon = slot->canon;
+  slot = dedup_find (&ctx->aliases, address_hash, obj, 0);
+  slot->obj = obj;
+  slot->canon = canon;
+  slot->hash = address_hash;
+  ctx->aliases.n++;
+  ctx->saved += Bhsize_hd (hd);
+  return 1;
+}
+
+// Second pass: find the leaf which [obj] is an alias of.
+static inline value
+dedup_canon (struct mark_ctx *ctx, value obj)
+{
+  return dedup_find (&ctx->aliases, hash_address (obj), obj, 0)->canon;
+}
+
+/* Intern table.
+ *
+ * Files can keep a table of the strings shared in them, under mmalloc
+ * key 1, so that a string is stored once whichever key it was shared
+ * under.  Interned strings are allocated on their own and are never
+ * freed, since any number of shared objects may point to them.
+ *
+ * In the first pass, the strings are looked up in (or added to) the
+ * table, and are then treated like the aliases of the dedup mode,
+ * their leaf being the interned string itself.
+ */
+
+#define INTERN_KEY 1
+
+struct intern_slot {
+  uintnat hash;
+  value str;			// Interned string in the file, or 0 if free.
+};
+
+struct intern_table {
+  size_t n;			// Number of strings.
+  size_t mask;			// Number of slots - 1, or 0 if none.
+  struct intern_slot *slots;
+};
+
+// Get the intern table of [md], creating it if necessary.
+static struct intern_table *
+intern_table (void *md)
+{
+  struct intern_table *t = mmalloc_getkey (md, INTERN_KEY);
+
+  if (t == 0) {
+    t = mmalloc (md, sizeof *t);
+    if (t == 0) return 0;
+    t->n = t->mask = 0;
+    t->slots = 0;
+    mmalloc_setkey (md, INTERN_KEY, t);
+  }
+  return t;
+}
+
+static struct intern_slot *
+intern_find (struct intern_table *t, uintnat hash, value str, mlsize_t wosize)
+{
+  size_t i = hash & t->mask;
+
+  for (;; i = (i + 1) & t->mask) {
+    struct intern_slot *slot = &t->slots[i];
+    if (slot->str == 0)
+      return slot;
+    if (slot->hash == hash && Wosize_val (slot->str) == wosize &&
+	memcmp ((void *) slot->str, (void *) str, Bsize_wsize (wosize)) == 0)
+      return slot;
+  }
+}
+
+static int
+intern_reserve (void *md, struct intern_table *t)
+{
+  struct intern_slot *old = t->slots;
+  size_t i, old_nr_slots = t->mask == 0 ? 0 : t->mask + 1;
+  size_t nr_slots = old_nr_slots == 0 ? 1024 : old_nr_slots * 2;
+
+  if ((t->n + 1) * 2 <= old_nr_slots)
+    return 0;
+
+  t->slots = mcalloc (md, nr_slots, sizeof (struct intern_slot));
+  if (t->slots == 0) {
+    t->slots = old;
+    return -1;
+  }
+  t->mask = nr_slots - 1;
+  for (i = 0; i < old_nr_slots; ++i)
+    if (old[i].str != 0) {
+      size_t j = old[i].hash & t->mask;
+      while (t->slots[j].str != 0)
+	j = (j + 1) & t->mask;
+      t->slots[j] = old[i];
+    }
+  if (old) mfree (md, old);
+  return 0;
+}
+
+// First pass: intern the unvisited string [obj].  Returns 1, or -1 if
+// we ran out of memory.
+static int
+intern_string (struct mark_ctx *ctx, value obj, header_t hd)
+{
+  void *md = ctx->ptr.data;
+  struct intern_table *t = ctx->intern;
+  uintnat address_hash = hash_address (obj);
+  mlsize_t wosize = Wosize_hd (hd);
+  struct intern_slot *slot;
+  struct dedup_slot *alias;
+
+  if (ctx->aliases.n > 0 &&
+      dedup_find (&ctx->aliases, address_hash, obj, 0)->obj != 0)
+    return 1;
+
+  if (dedup_reserve (&ctx->aliases) == -1 || intern_reserve (md, t) == -1)
+    return -1;
+
+  uintnat hash = hash_contents (obj, hd);
+  slot = intern_find (t, hash, obj, wosize);
+  if (slot->str != 0)
+    ctx->saved += Bhsize_wosize (wosize);
+  else {
+    char *copy_header = mmalloc (md, Bhsize_wosize (wosize));
+    if (copy_header == 0)
+      return -1;
+    Hd_hp (copy_header) = Ancient_blackhd_hd (hd);
+    memcpy ((void *) Val_hp (copy_header), (void *) obj, Bsize_wsize (wosize));
+    slot->hash = hash;
+    slot->str = Val_hp (copy_header);
+    t->n++;
+  }
+
+  alias = dedup_find (&ctx->aliases, address_hash, obj, 0);
+  alias->obj = obj;
+  alias->canon = slot->str;
+  alias->hash = address_hash;
+  ctx->aliases.n++;
+  return 1;
+}
+
+// An object whose fields have not all been scanned yet.
+struct mark_frame {
+  value obj;			// The object in the Caml heap.
+  value copy;			// Its copy (second pass only).
+  mlsize_t field;		// Next field to scan.
+};
+
+static inline int
+push_frame (struct mark_ctx *ctx, value obj, value copy)
+{
+  struct mark_frame frame = { obj, copy, 0 };
+  return area_append (&ctx->stack, &frame, sizeof frame);
+}
+
+static inline struct mark_frame *
+top_frame (struct mark_ctx *ctx)
+{
+  return (struct mark_frame *)
+    (ctx->stack.ptr + ctx->stack.n - sizeof (struct mark_frame));
+}
+
+// Find the next field of the object on top of the stack which points
+// to a block in the Caml heap.  The frame is returned in [r], with the
+// field number.  The object is popped from the stack before its last
+// such field is returned, so that the stack stays shallow for lists
+// and other right-leaning structures.  Returns 0 if there are no more
+// fields to scan.
+static inline int
+next_field (struct mark_ctx *ctx, mlsize_t wosize, struct mark_frame *r)
+{
+  struct mark_frame *frame = top_frame (ctx);
+  mlsize_t i;
+
+  for (i = frame->field; i < wosize; ++i) {
+    value field = Field (frame->obj, i);
+    if (Is_block (field) && Is_in_value_area (field))
+      break;
+  }
+
+  *r = *frame;
+  r->field = i;
+  if (i >= wosize - 1)
+    ctx->stack.n -= sizeof *frame;
+  else
+    frame->field = i + 1;
+  return i < wosize;
+}
 
 /*
- * obj: source object
- * ptr: destination
- * restore: a list of pointers that we modified that we should restore
-   at the end of the marking
- * fixups: a list of pointers that we have created that we may need to
-   update if we realloc the destination
+ * First pass: visit a single object (but not its subnodes), unless
+ * it has been visited already, and add its size to [ctx->size].
+ * Returns 0, -1 if we ran out of memory, or -2 if the object is too
+ * large to be visited.
  */
 
-static size_t
-_mark (value obj, area *ptr, area *restore, area *fixups)
+static int
+size_one (struct mark_ctx *ctx, value obj)
 {
   // XXX This assertion might fail if someone tries to mark an object
   // which is already ancient.
   assert (Is_in_value_area (obj));
 
-  header_t *header_ptr = (header_t *) Hp_val (obj);
-  header_t hd = Hd_hp (header_ptr);
+  header_t *header_ptr = (header_t *) Hp_val (obj);
+  header_t hd = Hd_hp (header_ptr);
+
+  if (is_visited (hd))
+    return 0;
+
+  mlsize_t wosize = Wosize_hd (hd);
+  int tag = Tag_hd (hd);
+
+  if (wosize == 0) {
+    /* we only need one copy of each atom */
+    if (ctx->atoms[tag] == 0) {
+      ctx->atoms[tag] = 1;
+      ctx->size += Bhsize_wosize (0);
+    }
+    return 0;
+  }
+
+  if (wosize > MAX_VISITED_WOSIZE)
+    return -2;
+
+  if (ctx->intern && tag == String_tag) {
+    int r = intern_string (ctx, obj, hd);
+    return r == 1 ? 0 : r;
+  }
+
+  int leaf = (ctx->flags & MARK_DEDUP) && is_leaf (obj, hd);
+  if (leaf) {
+    int r = dedup_leaf (ctx, obj, hd);
+    if (r != 0)
+      return r == 1 ? 0 : r;
+  }
+
+  // Push the object before modifying it, so that if we run out of
+  // memory the stack never has to grow while restoring (see
+  // restore_one).
+  if (tag < No_scan_tag && !leaf && push_frame (ctx, obj, 0) == -1)
+    return -1;			// Error out of memory.
+
+  Hd_hp (header_ptr) = visited_header (hd);
+  ctx->size += Bhsize_wosize (wosize);
+  if (aligned_block (ctx, wosize))
+    ctx->size += CACHE_LINE - sizeof (value); // Worst case padding.
+  return 0;
+}
+
+static int
+do_size (struct mark_ctx *ctx, value obj)
+{
+  int r = size_one (ctx, obj);
+
+  while (r == 0 && ctx->stack.n > 0) {
+    struct mark_frame frame;
+    header_t hd = original_header (Hd_val (top_frame (ctx)->obj));
+    if (next_field (ctx, Wosize_hd (hd), &frame))
+      r = size_one (ctx, Field (frame.obj, frame.field));
+  }
+
+  return r;
+}
+
+/*
+ * Second pass: copy a single object (but not its subnodes) to the
+ * out of heap area, unless it has been copied already.  Returns the
+ * copy.
+ */
+
+static value
+copy_one (struct mark_ctx *ctx, value obj)
+{
+  area *ptr = &ctx->ptr;
+  header_t *header_ptr = (header_t *) Hp_val (obj);
+  header_t hd = Hd_hp (header_ptr);
+
+  if (is_copied (hd))
+    return Val_hp (ptr->ptr + copied_offset (hd));
+
+  // In dedup mode, unvisited blocks which are not atoms are aliases.
+  // Interned strings are already out of the heap.
+  if (!is_visited (hd) && Wosize_hd (hd) > 0) {
+    value canon = dedup_canon (ctx, obj);
+    return Is_in_value_area (canon) ? copy_one (ctx, canon) : canon;
+  }
+
+  int atom = !is_visited (hd);
+  if (atom) {
+    int tag = Tag_hd (hd);
+    if (ctx->atoms[tag] == 0)
+      ctx->atoms[tag] = ptr->n + ATOM_OFFSET;
+    else
+      return Val_hp (ptr->ptr + ctx->atoms[tag] - ATOM_OFFSET);
+  }
+  else
+    hd = original_header (hd);
+
+  mlsize_t wosize = Wosize_hd (hd);
+  if (!atom && aligned_block (ctx, wosize) && ptr->n > 0) {
+    // Pad with a dummy block, so that the fields are aligned.  The
+    // root is not aligned since it must be at the start of the area.
+    size_t pad = - (uintnat) (ptr->ptr + ptr->n + sizeof (value))
+      & (CACHE_LINE - 1);
+    if (pad > 0) {
+      Hd_hp (ptr->ptr + ptr->n) =
+	Ancient_blackhd_hd (Make_header (Wsize_bsize (pad) - 1,
+					 Abstract_tag, 0));
+      ptr->n += pad;
+    }
+  }
+  size_t offset = ptr->n;
+  char *obj_copy_header = ptr->ptr + offset;
+  value obj_copy = Val_hp (obj_copy_header);
+  ptr->n += Bhsize_wosize (wosize);
+
+  // The copy keeps the original header until restore_one, which puts
+  // it back into the Caml heap.
+  Hd_hp (obj_copy_header) = atom ? Ancient_blackhd_hd (hd) : hd;
+  if (atom)
+    return obj_copy;
+
+  memcpy ((void *) obj_copy, (void *) obj, Bsize_wsize (wosize));
+  Hd_hp (header_ptr) = copied_header (offset);
+
+  // Remember to point the fields at the copies of their subnodes.
+  if (Tag_hd (hd) < No_scan_tag && !dedup_skip_push (ctx, obj, hd)) {
+    if ((ctx->flags & MARK_LAYOUT) == MARK_LAYOUT_DFS)
+      push_frame (ctx, obj, obj_copy); // Can't fail, see restore_one.
+    else {
+      struct mark_frame frame = { obj, obj_copy, 0 };
+      if (area_append (&ctx->queue, &frame, sizeof frame) == -1)
+	ctx->error = 1;
+    }
+  }
+
+  return obj_copy;
+}
+
+static value
+do_copy (struct mark_ctx *ctx, value obj)
+{
+  value copy = copy_one (ctx, obj);
+
+  while (ctx->stack.n > 0) {
+    struct mark_frame frame;
+    if (next_field (ctx, Wosize_val (top_frame (ctx)->copy), &frame))
+      Field (frame.copy, frame.field) =
+	copy_one (ctx, Field (frame.obj, frame.field));
+  }
+
+  return copy;
+}
+
+/* The BFS and clustered layouts use a queue of objects whose fields
+ * haven't been copied yet instead of the stack.  The queue can get
+ * much longer than the stack, so unlike do_copy this can run out of
+ * memory.
+ *
+ * In the clustered layout, objects are copied breadth first as long
+ * as they fit in the current cluster.  The subnodes which don't fit
+ * are put aside, and each of them starts a new cluster later, so that
+ * a subtree is laid out in a few consecutive pages rather than spread
+ * over the whole area.
+ */
+
+struct pending_field {
+  value *field;			// Field of a copy to fill in.
+  value obj;			// Subnode of the original.
+};
+
+static int
+fits_in_cluster (struct mark_ctx *ctx, value obj)
+{
+  header_t hd = Hd_val (obj);
+
+  if (!is_visited (hd) || is_copied (hd))
+    return 1;			// Nothing to copy, or atom or alias.
+  return ctx->ptr.n - ctx->cluster_start +
+    Bhsize_hd (original_header (hd)) <= CLUSTER_SIZE;
+}
+
+static void
+queue_pop (struct mark_ctx *ctx, struct mark_frame *frame)
+{
+  memcpy (frame, ctx->queue.ptr + ctx->queue_head, sizeof *frame);
+  ctx->queue_head += sizeof *frame;
+
+  if (ctx->queue_head == ctx->queue.n)
+    ctx->queue.n = ctx->queue_head = 0;
+  else if (ctx->queue_head >= 4096 * sizeof *frame &&
+	   ctx->queue_head * 2 >= ctx->queue.n) {
+    // Reuse the space at the start of the queue.
+    memmove (ctx->queue.ptr, ctx->queue.ptr + ctx->queue_head,
+	     ctx->queue.n - ctx->queue_head);
+    ctx->queue.n -= ctx->queue_head;
+    ctx->queue_head = 0;
+  }
+}
+
+static int
+do_copy_bfs (struct mark_ctx *ctx, value obj)
+{
+  int clustered = (ctx->flags & MARK_LAYOUT) == MARK_LAYOUT_CLUSTERED;
+
+  copy_one (ctx, obj);
+
+  for (;;) {
+    while (ctx->queue.n > ctx->queue_head && !ctx->error) {
+      struct mark_frame frame;
+      mlsize_t i, wosize;
+
+      queue_pop (ctx, &frame);
+      wosize = Wosize_val (frame.copy);
+
+      for (i = 0; i < wosize; ++i) {
+	value field = Field (frame.obj, i);
+	if (!Is_block (field) || !Is_in_value_area (field))
+	  continue;
+	if (clustered && !fits_in_cluster (ctx, field)) {
+	  struct pending_field pending = { &Field (frame.copy, i), field };
+	  if (area_append (&ctx->pending, &pending, sizeof pending) == -1)
+	    return -1;
+	}
+	else
+	  Field (frame.copy, i) = copy_one (ctx, field);
+      }
+    }
+    if (ctx->error)
+      return -1;
+    if (ctx->pending.n == 0)
+      return 0;
+
+    // Start a new cluster.
+    struct pending_field *pending;
+    ctx->pending.n -= sizeof *pending;
+    pending = (struct pending_field *) (ctx->pending.ptr + ctx->pending.n);
+    ctx->cluster_start = ctx->ptr.n;
+    *pending->field = copy_one (ctx, pending->obj);
+  }
+}
+
+/*
+ * Third pass: restore the original header of a single object, from
+ * its copy, or from its visited header if it hasn't been copied
+ * because we are recovering from an error.
+ *
+ * The second pass visits exactly the same objects in the same order
+ * as the first one, and so does this pass, so the stack is never any
+ * deeper than it was during the first pass.  That is why pushing
+ * frames after the first pass can't fail: the stack area is already
+ * large enough.
+ */
+
+static void
+restore_one (struct mark_ctx *ctx, value obj)
+{
+  header_t *header_ptr = (header_t *) Hp_val (obj);
+  header_t hd = Hd_hp (header_ptr);
+
+  if (!is_visited (hd))
+    return;			// Atom, alias, or already restored.
+
+  if (is_copied (hd)) {
+    char *obj_copy_header = ctx->ptr.ptr + copied_offset (hd);
+
+    // Restore the original header
+    hd = Hd_hp (obj_copy_header);
+
+    // Color the destination header in black
+    Hd_hp (obj_copy_header) = Ancient_blackhd_hd (hd);
+  }
+  else
+    hd = original_header (hd);
+
+  Hd_hp (header_ptr) = hd;
+
+  if (Tag_hd (hd) < No_scan_tag && !dedup_skip_push (ctx, obj, hd))
+    push_frame (ctx, obj, 0);
+}
+
+static void
+do_restore (struct mark_ctx *ctx, value obj)
+{
+  restore_one (ctx, obj);
+
+  while (ctx->stack.n > 0) {
+    struct mark_frame frame;
+    if (next_field (ctx, Wosize_val (top_frame (ctx)->obj), &frame))
+      restore_one (ctx, Field (frame.obj, frame.field));
+  }
+}
+
+// Raise the exception for an allocation which failed in md, or in the
+// C heap if md is 0.  Errors from the file, such as running out of disk
+// space, are reported as Sys_error.
+static void
+alloc_failed (void *md)
+{
+  if (md && mmalloc_errno (md) != 0) {
+    errno = mmalloc_errno (md);
+    caml_sys_error (NO_ARG);
+  }
+  caml_failwith ("out of memory");
+}
+
+// Extra information about a mark, see type Ancient.info.
+struct mark_info {
+  size_t size;			// Allocated size, bytes.
+  size_t temp_size;		// Temporary memory used while marking, bytes.
+  size_t saved;			// Bytes saved by the dedup and intern modes.
+  size_t used;			// Bytes of the area holding objects.
+};
+
+static void *
+mark (value obj, int flags,
+      void *(*realloc)(void *data, void *ptr, size_t size),
+      void (*free)(void *data, void *ptr),
+      void *data,
+      struct mark_info *info)
+{
+  struct mark_ctx ctx;
+  mark_ctx_init (&ctx, flags, realloc, free, data);
+
+  // Only files have an intern table.  Other writers use it too, so
+  // the file stays locked until the copy is done.
+  if ((flags & MARK_INTERN) && realloc == mrealloc) {
+    if (mmalloc_lock (data) != 0) alloc_failed (data);
+    ctx.intern = intern_table (data);
+    if (ctx.intern == 0) {
+      mmalloc_unlock (data);
+      alloc_failed (data);
+    }
+  }
+
+  int r = do_size (&ctx, obj);
+  if (r == 0 && Wsize_bsize (ctx.size) >= COPIED_BIT)
+    r = -2;
+  if (r == 0 && area_reserve (&ctx.ptr, ctx.size) == -1)
+    r = -3;
+  if (r != 0) {
+    // Recover and throw an exception.
+    ctx.stack.n = 0;
+    do_restore (&ctx, obj);
+    area_free (&ctx.stack);
+    dedup_free (&ctx);
+    if (ctx.intern) mmalloc_unlock (data);
+    if (r == -2) caml_failwith ("object too large");
+    if (r == -3) alloc_failed (realloc == mrealloc ? data : 0);
+    caml_failwith ("out of memory");
+  }
+  size_t temp_size =
+    ctx.stack.size +
+    dedup_table_size (&ctx.leaves) + dedup_table_size (&ctx.aliases);
+
+  // Copy the objects out of the Caml heap.
+  memset (ctx.atoms, 0, sizeof ctx.atoms);
+  assert (ctx.stack.n == 0);
+  if ((flags & MARK_LAYOUT) == MARK_LAYOUT_DFS)
+    do_copy (&ctx, obj);
+  else
+    r = do_copy_bfs (&ctx, obj);
+  // Blocks aligned on cache lines may need less padding than allowed.
+  assert (r != 0 || ctx.ptr.n == ctx.size ||
+	  ((flags & MARK_ALIGN) && ctx.ptr.n < ctx.size));
+  temp_size += ctx.queue.size + ctx.pending.size;
+  area_free (&ctx.queue);
+  area_free (&ctx.pending);
+
+  // Restore Caml heap structures.
+  do_restore (&ctx, obj);
+  area_free (&ctx.stack);
+  dedup_free (&ctx);
+  if (ctx.intern) mmalloc_unlock (data);
+
+  if (r != 0) {
+    area_free (&ctx.ptr);
+    caml_failwith ("out of memory");
+  }
+
+  if (info) {
+    info->size = ctx.ptr.size;
+    info->temp_size = temp_size;
+    info->saved = ctx.saved;
+    info->used = ctx.ptr.n;
+  }
+  return ctx.ptr.ptr;
+}
+
+/* Parallel mark.
+ *
+ * For very large graphs, the mark can be split between several
+ * threads.  The visited header trick above can't be used here, since
+ * several threads would race to modify the same headers, so the
+ * objects which have been visited are kept in a concurrent hash table
+ * on the side instead, and the Caml heap is never modified.
+ *
+ * 1. Each worker thread scans objects from its own stack.  The first
+ * worker to add an object to the visited table owns it: it reserves
+ * space for the copy in its own chunk, remembers the object in its
+ * list and pushes it on its stack.  Workers which run out of work take
+ * it from the pool, to which busy workers give half of their stack
+ * whenever some workers are idle.
+ * 2. Once all the workers are idle, the size of the area is known and
+ * it is allocated in one go, each worker's chunk following the other.
+ * 3. Each worker copies the objects of its list into its chunk, using
+ * the visited table to find the copies of the fields.
+ *
+ * The Caml runtime is held by the calling thread throughout, so the
+ * Caml heap doesn't change under our feet.  The visited table needs
+ * two words per slot and the lists one word per object, so this uses
+ * a lot more temporary memory than mark above.
+ */
+
+#define MAX_THREADS 256		// Worker number is stored in 8 bits.
+
+#define VISITED_SHARDS_LOG 10
+#define VISITED_SHARDS (1 << VISITED_SHARDS_LOG)
+
+struct visited_slot {
+  value obj;			// Object in the Caml heap, or 0 if free.
+  size_t where;			// Offset of the copy in the chunk << 8
+				// | worker owning the object.
+};
+
+// The visited table is split into shards, each with its own lock and
+// growing independently, to keep contention between workers low.
+struct visited_shard {
+  pthread_mutex_t lock;
+  size_t n;			// Number of objects.
+  size_t mask;			// Number of slots - 1, or 0 if none.
+  struct visited_slot *slots;
+} __attribute__((aligned (64)));
+
+static inline uint64_t
+hash_obj (value obj)
+{
+  return ((uint64_t) obj >> 3) * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline struct visited_slot *
+visited_find (struct visited_shard *shard, uint64_t h, value obj)
+{
+  size_t i = (h ^ (h >> 29)) & shard->mask;
+  while (shard->slots[i].obj != 0 && shard->slots[i].obj != obj)
+    i = (i + 1) & shard->mask;
+  return &shard->slots[i];
+}
+
+static int
+visited_grow (struct visited_shard *shard)
+{
+  size_t nr_slots = shard->mask == 0 ? 64 : (shard->mask + 1) * 2;
+  struct visited_slot *old = shard->slots;
+  size_t old_nr_slots = shard->mask == 0 ? 0 : shard->mask + 1;
+  size_t i;
+
+  shard->slots = calloc (nr_slots, sizeof (struct visited_slot));
+  if (shard->slots == 0) {
+    shard->slots = old;
+    return -1;
+  }
+  shard->mask = nr_slots - 1;
+  for (i = 0; i < old_nr_slots; ++i)
+    if (old[i].obj != 0)
+      *visited_find (shard, hash_obj (old[i].obj), old[i].obj) = old[i];
+  free (old);
+  return 0;
+}
+
+struct par_mark;
+
+struct par_worker {
+  struct par_mark *pm;
+  int id;
+  pthread_t thread;
+  area stack;			// Objects to be scanned.
+  area objs;			// Objects owned by this worker.
+  size_t size;			// Size of this worker's chunk.
+  size_t base;			// Offset of the chunk in the out of heap area.
+};
+
+struct par_mark {
+  struct visited_shard *shards;
+  struct par_worker *workers;
+  char *ptr;			// The out of heap area (third step).
+  pthread_mutex_t lock;		// Protects the fields below.
+  pthread_cond_t cond;
+  area pool;			// Work given away by busy workers.
+  int nr_workers;
+  int idle;			// Number of workers waiting for work
+				// (also read without the lock).
+  int done;
+  int error;			// Out of memory (ditto).
+};
+
+// Add [obj] to the visited table.  Returns 1 if it was added by this
+// call, 0 if it was there already, or -1 if we ran out of memory.
+static int
+visited_add (struct par_mark *pm, value obj, size_t where)
+{
+  uint64_t h = hash_obj (obj);
+  struct visited_shard *shard = &pm->shards[h >> (64 - VISITED_SHARDS_LOG)];
+  struct visited_slot *slot;
+  int r = 0;
+
+  pthread_mutex_lock (&shard->lock);
+  if ((shard->n + 1) * 2 > shard->mask + 1 && visited_grow (shard) == -1)
+    r = -1;
+  else {
+    slot = visited_find (shard, h, obj);
+    if (slot->obj == 0) {
+      slot->obj = obj;
+      slot->where = where;
+      shard->n++;
+      r = 1;
+    }
+  }
+  pthread_mutex_unlock (&shard->lock);
+  return r;
+}
+
+// Find the copy of [obj], once all the objects have been visited.
+static inline value
+visited_copy (struct par_mark *pm, value obj)
+{
+  uint64_t h = hash_obj (obj);
+  struct visited_shard *shard = &pm->shards[h >> (64 - VISITED_SHARDS_LOG)];
+  size_t where = visited_find (shard, h, obj)->where;
+  struct par_worker *w = &pm->workers[where & (MAX_THREADS - 1)];
+  return Val_hp (pm->ptr + w->base + (where >> 8));
+}
+
+static int
+par_visit (struct par_worker *w, value obj)
+{
+  header_t hd = Hd_val (obj);
+  int r = visited_add (w->pm, obj, w->size << 8 | w->id);
+
+  if (r != 1)
+    return r;
+  w->size += Bhsize_hd (hd);
+  if (area_append (&w->objs, &obj, sizeof obj) == -1)
+    return -1;
+  if (Tag_hd (hd) < No_scan_tag && Wosize_hd (hd) > 0 &&
+      area_append (&w->stack, &obj, sizeof obj) == -1)
+    return -1;
+  return 0;
+}
+
+static void
+par_error (struct par_mark *pm)
+{
+  pthread_mutex_lock (&pm->lock);
+  __atomic_store_n (&pm->error, 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast (&pm->cond);
+  pthread_mutex_unlock (&pm->lock);
+}
+
+// Give the oldest half of our stack to the idle workers.
+static int
+par_share_work (struct par_worker *w)
+{
+  struct par_mark *pm = w->pm;
+  size_t half = (w->stack.n / sizeof (value) / 2) * sizeof (value);
+  int r;
+
+  pthread_mutex_lock (&pm->lock);
+  r = area_append (&pm->pool, w->stack.ptr, half);
+  if (r == 0) {
+    memmove (w->stack.ptr, w->stack.ptr + half, w->stack.n - half);
+    w->stack.n -= half;
+    pthread_cond_broadcast (&pm->cond);
+  }
+  pthread_mutex_unlock (&pm->lock);
+  return r;
+}
+
+// Wait until there is some work in the pool and take it.  Returns 0
+// when the mark is finished, or if another worker failed.
+static int
+par_take_work (struct par_worker *w)
+{
+  struct par_mark *pm = w->pm;
+  int r = 0;
+
+  pthread_mutex_lock (&pm->lock);
+  __atomic_add_fetch (&pm->idle, 1, __ATOMIC_RELAXED);
+  while (pm->pool.n == 0 && !pm->done && !pm->error) {
+    if (pm->idle == pm->nr_workers) {
+      pm->done = 1;
+      pthread_cond_broadcast (&pm->cond);
+    }
+    else
+      pthread_cond_wait (&pm->cond, &pm->lock);
+  }
+  if (pm->pool.n > 0 && !pm->error) {
+    if (area_append (&w->stack, pm->pool.ptr, pm->pool.n) == 0) {
+      pm->pool.n = 0;
+      __atomic_sub_fetch (&pm->idle, 1, __ATOMIC_RELAXED);
+      r = 1;
+    }
+    else {
+      __atomic_store_n (&pm->error, 1, __ATOMIC_RELAXED);
+      pthread_cond_broadcast (&pm->cond);
+    }
+  }
+  pthread_mutex_unlock (&pm->lock);
+  return r;
+}
+
+// Pop the object on top of the worker's stack and visit its fields.
+static int
+par_scan_one (struct par_worker *w)
+{
+  value obj;
+  mlsize_t i, wosize;
+
+  w->stack.n -= sizeof obj;
+  obj = *(value *) (w->stack.ptr + w->stack.n);
+  wosize = Wosize_val (obj);
+  for (i = 0; i < wosize; ++i) {
+    value field = Field (obj, i);
+    if (Is_block (field) && Is_in_value_area (field) &&
+	par_visit (w, field) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+static void *
+par_visit_worker (void *vw)
+{
+  struct par_worker *w = vw;
+  struct par_mark *pm = w->pm;
+
+  do {
+    while (w->stack.n > 0) {
+      if (__atomic_load_n (&pm->error, __ATOMIC_RELAXED))
+	return 0;
+
+      if (par_scan_one (w) == -1) {
+	par_error (pm);
+	return 0;
+      }
+
+      if (w->stack.n >= 2 * sizeof (value) &&
+	  __atomic_load_n (&pm->idle, __ATOMIC_RELAXED) > 0 &&
+	  par_share_work (w) == -1) {
+	par_error (pm);
+	return 0;
+      }
+    }
+  } while (par_take_work (w));
+
+  return 0;
+}
+
+// Copy [obj] to [copy_header], once all the objects have been
+// visited.  Returns where the next copy goes.
+static char *
+par_copy_one (struct par_mark *pm, value obj, char *copy_header)
+{
+  header_t hd = Hd_val (obj);
+  mlsize_t j, wosize = Wosize_hd (hd);
+  value copy = Val_hp (copy_header);
+
+  Hd_hp (copy_header) = Ancient_blackhd_hd (hd);
+  if (Tag_hd (hd) < No_scan_tag)
+    for (j = 0; j < wosize; ++j) {
+      value field = Field (obj, j);
+      if (Is_block (field) && Is_in_value_area (field))
+	field = visited_copy (pm, field);
+      Field (copy, j) = field;
+    }
+  else
+    memcpy ((void *) copy, (void *) obj, Bsize_wsize (wosize));
+  return copy_header + Bhsize_wosize (wosize);
+}
+
+static void *
+par_copy_worker (void *vw)
+{
+  struct par_worker *w = vw;
+  char *copy_header = w->pm->ptr + w->base;
+  size_t i;
+
+  for (i = 0; i < w->objs.n / sizeof (value); ++i)
+    copy_header = par_copy_one (w->pm, ((value *) w->objs.ptr)[i],
+				copy_header);
+
+  return 0;
+}
+
+// Run [fn] on all the workers, the calling thread being the first
+// one.  If a thread can't be started, the remaining workers run in the
+// calling thread afterwards, except for the visiting step, where the
+// work is simply shared between the workers which did start.
+static void
+par_run (struct par_mark *pm, void *(*fn) (void *))
+{
+  int i, nr_started;
+
+  for (i = 1; i < pm->nr_workers; ++i)
+    if (pthread_create (&pm->workers[i].thread, 0, fn, &pm->workers[i]) != 0)
+      break;
+  nr_started = i;
+
+  if (fn == par_visit_worker && nr_started < pm->nr_workers) {
+    pthread_mutex_lock (&pm->lock);
+    pm->nr_workers = nr_started;
+    pthread_cond_broadcast (&pm->cond);
+    pthread_mutex_unlock (&pm->lock);
+  }
+
+  fn (&pm->workers[0]);
+
+  for (i = 1; i < pm->nr_workers; ++i) {
+    if (i < nr_started)
+      pthread_join (pm->workers[i].thread, 0);
+    else
+      fn (&pm->workers[i]);
+  }
+}
+
+static int
+par_mark_init (struct par_mark *pm, int nr_threads)
+{
+  int i;
+
+  memset (pm, 0, sizeof *pm);
+  pm->shards = calloc (VISITED_SHARDS, sizeof (struct visited_shard));
+  pm->workers = calloc (MAX_THREADS, sizeof (struct par_worker));
+  if (pm->shards == 0 || pm->workers == 0) {
+    free (pm->shards);
+    free (pm->workers);
+    return -1;
+  }
+  for (i = 0; i < VISITED_SHARDS; ++i)
+    pthread_mutex_init (&pm->shards[i].lock, 0);
+  pthread_mutex_init (&pm->lock, 0);
+  pthread_cond_init (&pm->cond, 0);
+  area_init (&pm->pool);
+  pm->nr_workers = nr_threads;
+  for (i = 0; i < nr_threads; ++i) {
+    pm->workers[i].pm = pm;
+    pm->workers[i].id = i;
+    area_init (&pm->workers[i].stack);
+    area_init (&pm->workers[i].objs);
+  }
+  return 0;
+}
+
+static void
+par_mark_free (struct par_mark *pm, size_t *temp_size)
+{
+  size_t temp = pm->pool.size;
+  int i;
+
+  for (i = 0; i < VISITED_SHARDS; ++i) {
+    struct visited_shard *shard = &pm->shards[i];
+    if (shard->mask != 0)
+      temp += (shard->mask + 1) * sizeof (struct visited_slot);
+    free (shard->slots);
+    pthread_mutex_destroy (&shard->lock);
+  }
+  for (i = 0; i < MAX_THREADS && pm->workers[i].pm; ++i) {
+    temp += pm->workers[i].stack.size + pm->workers[i].objs.size;
+    area_free (&pm->workers[i].stack);
+    area_free (&pm->workers[i].objs);
+  }
+  area_free (&pm->pool);
+  pthread_mutex_destroy (&pm->lock);
+  pthread_cond_destroy (&pm->cond);
+  free (pm->shards);
+  free (pm->workers);
+
+  if (temp_size)
+    *temp_size = temp;
+}
+
+static void *
+mark_parallel (value obj, int nr_threads,
+	       void *(*realloc)(void *data, void *ptr, size_t size),
+	       void (*free)(void *data, void *ptr),
+	       void *data,
+	       struct mark_info *info)
+{
+  struct par_mark pm;
+  area ptr;
+  size_t size = 0;
+  int i, r = 0;
+
+  if (nr_threads < 1 || nr_threads > MAX_THREADS)
+    caml_invalid_argument ("Ancient.mark_parallel: threads");
+  // XXX This assertion might fail if someone tries to mark an object
+  // which is already ancient.
+  assert (Is_in_value_area (obj));
+
+  if (par_mark_init (&pm, nr_threads) == -1)
+    caml_failwith ("out of memory");
+
+  // Visit all the objects.
+  if (par_visit (&pm.workers[0], obj) == -1)
+    pm.error = 1;
+  else
+    par_run (&pm, par_visit_worker);
+  if (pm.error)
+    r = -1;
+
+  // Allocate the out of heap area, and copy the objects into it.
+  area_init_custom (&ptr, realloc, free, data);
+  if (r == 0) {
+    for (i = 0; i < pm.nr_workers; ++i) {
+      pm.workers[i].base = size;
+      size += pm.workers[i].size;
+    }
+    if (area_reserve (&ptr, size) == -1)
+      r = -3;
+  }
+  if (r == 0) {
+    pm.ptr = ptr.ptr;
+    par_run (&pm, par_copy_worker);
+  }
+
+  par_mark_free (&pm, info ? &info->temp_size : 0);
+  if (r == -3)
+    alloc_failed (realloc == mrealloc ? data : 0);
+  if (r != 0)
+    caml_failwith ("out of memory");
+
+  if (info) {
+    info->size = ptr.size;
+    info->saved = 0;
+    info->used = ptr.size;
+  }
+  return ptr.ptr;
+}
+
+static void *
+my_realloc (void *data __attribute__((unused)), void *ptr, size_t size)
+{
+  return realloc (ptr, size);
+}
+
+static void
+my_free (void *data __attribute__((unused)), void *ptr)
+{
+  return free (ptr);
+}
+
+// Size of transparent huge pages.
+#define HUGEPAGE_SIZE ((size_t) 2 << 20)
+
+// Same as my_realloc, but large new areas are aligned on huge pages
+// and the kernel is asked to back them with transparent huge pages,
+// which saves TLB misses on random accesses.  Like any other area,
+// they can be freed with my_free.
+static void *
+my_realloc_huge (void *data, void *ptr, size_t size)
+{
+  if (ptr != 0 || size < HUGEPAGE_SIZE)
+    return my_realloc (data, ptr, size);
+
+  size = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+  if (posix_memalign (&ptr, HUGEPAGE_SIZE, size) != 0)
+    return 0;
+#ifdef MADV_HUGEPAGE
+  madvise (ptr, size, MADV_HUGEPAGE); // Only a hint.
+#endif
+  return ptr;
+}
+
+static value
+alloc_info (const struct mark_info *mark_info)
+{
+  value info = caml_alloc (3, 0);
+  Field (info, 0) = Val_long (mark_info->size);
+  Field (info, 1) = Val_long (mark_info->temp_size);
+  Field (info, 2) = Val_long (mark_info->saved);
+  return info;
+}
+
+CAMLprim value
+ancient_mark_info (value flagsv, value obj)
+{
+  CAMLparam2 (flagsv, obj);
+  CAMLlocal3 (proxy, info, rv);
+
+  int flags = Int_val (flagsv);
+  struct mark_info mark_info;
+  void *ptr = mark (obj, flags,
+		    flags & MARK_HUGEPAGES ? my_realloc_huge : my_realloc,
+		    my_free, 0, &mark_info);
+
+  // Make the proxy.
+  proxy = caml_alloc (1, Abstract_tag);
+  Field (proxy, 0) = (value) ptr;
+
+  // Make the info struct.
+  info = alloc_info (&mark_info);
+
+  rv = caml_alloc (2, 0);
+  Field (rv, 0) = proxy;
+  Field (rv, 1) = info;
+
+  CAMLreturn (rv);
+}
+
+CAMLprim value
+ancient_mark_parallel_info (value threadsv, value obj)
+{
+  CAMLparam2 (threadsv, obj);
+  CAMLlocal3 (proxy, info, rv);
+
+  struct mark_info mark_info;
+  void *ptr = mark_parallel (obj, Int_val (threadsv),
+			     my_realloc, my_free, 0, &mark_info);
+
+  // Make the proxy.
+  proxy = caml_alloc (1, Abstract_tag);
+  Field (proxy, 0) = (value) ptr;
+
+  // Make the info struct.
+  info = alloc_info (&mark_info);
+
+  rv = caml_alloc (2, 0);
+  Field (rv, 0) = proxy;
+  Field (rv, 1) = info;
+
+  CAMLreturn (rv);
+}
+
+/* Incremental mark.
+ *
+ * This is the parallel mark above with a single worker, run a bit at
+ * a time.  Caml code runs between the steps, so the headers of the
+ * objects can't be touched at all: a visited header would be seen by
+ * the GC.  The visited table on the side is what makes this possible.
+ *
+ * The objects are remembered by address, so they must not move
+ * between the steps.  Ancient.mark_start empties the minor heap first,
+ * and the Caml side checks that the heap has not been compacted since.
+ */
+
+struct inc_mark {
+  struct par_mark pm;		// With a single worker.
+  int copying;			// Set once all objects have been visited.
+  size_t next;			// Next object to copy.
+  char *copy_header;		// Where it goes.
+};
+
+static void
+inc_mark_free (struct inc_mark *im, size_t *temp_size)
+{
+  par_mark_free (&im->pm, temp_size);
+  free (im);
+}
+
+// Do up to [work] units of work, each being to scan or copy one
+// object.  Returns 1 when the mark is complete, 0 if there is more
+// work to do, or -1 if we ran out of memory.
+static int
+inc_mark_step (struct inc_mark *im, intnat work)
+{
+  struct par_worker *w = &im->pm.workers[0];
+  size_t nr_objs = w->objs.n / sizeof (value);
+
+  for (; work > 0; --work) {
+    if (!im->copying) {
+      if (w->stack.n > 0) {
+	if (par_scan_one (w) == -1)
+	  return -1;
+	continue;
+      }
+
+      // All the objects have been visited, allocate the area.
+      nr_objs = w->objs.n / sizeof (value);
+      im->pm.ptr = malloc (w->size);
+      if (im->pm.ptr == 0)
+	return -1;
+      im->copy_header = im->pm.ptr;
+      im->copying = 1;
+    }
+
+    if (im->next == nr_objs)
+      break;
+    im->copy_header =
+      par_copy_one (&im->pm, ((value *) w->objs.ptr)[im->next++],
+		    im->copy_header);
+  }
+
+  return im->copying && im->next == nr_objs;
+}
+
+static struct inc_mark *
+inc_mark_of_val (value imv)
+{
+  if (Is_long (Field (imv, 0))) caml_invalid_argument ("finished");
+  return (struct inc_mark *) Field (imv, 0);
+}
+
+CAMLprim value
+ancient_mark_start (value obj)
+{
+  CAMLparam1 (obj);
+  CAMLlocal1 (imv);
+
+  // XXX This assertion might fail if someone tries to mark an object
+  // which is already ancient.
+  assert (Is_in_value_area (obj));
+
+  struct inc_mark *im = malloc (sizeof *im);
+  if (im == 0) caml_failwith ("out of memory");
+  if (par_mark_init (&im->pm, 1) == -1) {
+    free (im);
+    caml_failwith ("out of memory");
+  }
+  im->copying = 0;
+  im->next = 0;
+  im->copy_header = 0;
+  if (par_visit (&im->pm.workers[0], obj) == -1) {
+    inc_mark_free (im, 0);
+    caml_failwith ("out of memory");
+  }
+
+  imv = caml_alloc (1, Abstract_tag);
+  Field (imv, 0) = (value) im;
+
+  CAMLreturn (imv);
+}
+
+CAMLprim value
+ancient_mark_abort (value imv)
+{
+  CAMLparam1 (imv);
+
+  struct inc_mark *im = inc_mark_of_val (imv);
+  free (im->pm.ptr);
+  inc_mark_free (im, 0);
+  Field (imv, 0) = Val_long (0);
+
+  CAMLreturn (Val_unit);
+}
+
+CAMLprim value
+ancient_mark_step (value imv, value workv)
+{
+  CAMLparam2 (imv, workv);
+
+  struct inc_mark *im = inc_mark_of_val (imv);
+  int r = inc_mark_step (im, Long_val (workv));
+  if (r == -1) {
+    ancient_mark_abort (imv);
+    caml_failwith ("out of memory");
+  }
+
+  CAMLreturn (Val_bool (r));
+}
+
+CAMLprim value
+ancient_mark_finish_info (value imv)
+{
+  CAMLparam1 (imv);
+  CAMLlocal3 (proxy, info, rv);
+
+  struct inc_mark *im = inc_mark_of_val (imv);
+  if (inc_mark_step (im, Max_long) == -1) {
+    ancient_mark_abort (imv);
+    caml_failwith ("out of memory");
+  }
+
+  struct mark_info mark_info;
+  void *ptr = im->pm.ptr;
+  mark_info.size = mark_info.used = im->pm.workers[0].size;
+  mark_info.saved = 0;
+  inc_mark_free (im, &mark_info.temp_size);
+  Field (imv, 0) = Val_long (0);
+
+  // Make the proxy.
+  proxy = caml_alloc (1, Abstract_tag);
+  Field (proxy, 0) = (value) ptr;
+
+  // Make the info struct.
+  info = alloc_info (&mark_info);
+
+  rv = caml_alloc (2, 0);
+  Field (rv, 0) = proxy;
+  Field (rv, 1) = info;
+
+  CAMLreturn (rv);
+}
+
+CAMLprim value
+ancient_follow (value obj)
+{
+  CAMLparam1 (obj);
+  CAMLlocal1 (v);
+
+  v = Field (obj, 0);
+  if (Is_long (v)) caml_invalid_argument ("deleted");
+  v = Val_hp (v); // v points to the header; make it point to the object.
+
+  // Member of a batch: v is the array of roots, see ancient_mark_many.
+  if (Wosize_val (obj) == 2) {
+    mlsize_t i = Long_val (Field (obj, 1));
+    if (Tag_val (v) == Double_array_tag)
+      v = caml_copy_double (Double_flat_field (v, i));
+    else
+      v = Field (v, i);
+  }
+
+  CAMLreturn (v);
+}
+
+CAMLprim value
+ancient_delete (value obj)
+{
+  CAMLparam1 (obj);
+  CAMLlocal1 (v);
+
+  v = Field (obj, 0);
+  if (Is_long (v)) caml_invalid_argument ("deleted");
+  if (Wosize_val (obj) == 2) caml_invalid_argument ("Ancient.delete: batch");
+
+  // Otherwise v is a pointer to the out of heap malloc'd object.
+  assert (!Is_in_heap_or_young (v));
+  free ((void *) v);
+
+  // Replace the proxy (a pointer) with an int 0 so we know it's
+  // been deleted in future.
+  Field (obj, 0) = Val_long (0);
+
+  CAMLreturn (Val_unit);
+}
+
+/* Batches.
+ *
+ * The roots of a batch are marked together, by marking the array
+ * which holds them, so the objects they share are copied once and the
+ * whole batch is in one allocation.  The proxy of each root is the
+ * pointer to the copy of the array and the index of the root in it.
+ */
+
+static mlsize_t
+batch_length (value roots)
+{
+  if (Tag_val (roots) == Double_array_tag)
+    return Wosize_val (roots) / Double_wosize;
+  return Wosize_val (roots);
+}
+
+static value
+alloc_batch (void *ptr, mlsize_t n)
+{
+  CAMLparam0 ();
+  CAMLlocal2 (proxies, proxy);
+  mlsize_t i;
+
+  proxies = caml_alloc (n, 0);
+  for (i = 0; i < n; ++i) {
+    proxy = caml_alloc (2, Abstract_tag);
+    Field (proxy, 0) = (value) ptr;
+    Field (proxy, 1) = Val_long (i);
+    Store_field (proxies, i, proxy);
+  }
+
+  CAMLreturn (proxies);
+}
+
+CAMLprim value
+ancient_mark_many (value roots)
+{
+  CAMLparam1 (roots);
+  CAMLlocal1 (proxies);
+
+  void *ptr = mark (roots, 0, my_realloc, my_free, 0, 0);
+  proxies = alloc_batch (ptr, batch_length (roots));
+
+  CAMLreturn (proxies);
+}
+
+CAMLprim value
+ancient_delete_many (value proxies)
+{
+  CAMLparam1 (proxies);
+  CAMLlocal1 (v);
+
+  mlsize_t i, n = Wosize_val (proxies);
+  if (n == 0) CAMLreturn (Val_unit);
+
+  // All the proxies of the batch must be there, and nothing else.
+  v = Field (Field (proxies, 0), 0);
+  if (Is_long (v)) caml_invalid_argument ("deleted");
+  for (i = 0; i < n; ++i)
+    if (Wosize_val (Field (proxies, i)) != 2 ||
+	Field (Field (proxies, i), 0) != v)
+      caml_invalid_argument ("Ancient.delete_many");
+  if (batch_length (Val_hp (v)) != n)
+    caml_invalid_argument ("Ancient.delete_many");
+
+  assert (!Is_in_heap_or_young (v));
+  free ((void *) v);
+
+  for (i = 0; i < n; ++i)
+    Field (Field (proxies, i), 0) = Val_long (0);
+
+  CAMLreturn (Val_unit);
+}
+
+CAMLprim value
+ancient_is_ancient (value obj)
+{
+  CAMLparam1 (obj);
+  CAMLlocal1 (v);
+
+  v = Is_in_heap_or_young (obj) ? Val_false : Val_true;
+
+  CAMLreturn (v);
+}
+
+CAMLprim value
+ancient_address_of (value obj)
+{
+  CAMLparam1 (obj);
+  CAMLlocal1 (v);
+
+  if (Is_block (obj)) v = caml_copy_nativeint ((intnat) obj);
+  else v = caml_copy_nativeint (0);
+
+  CAMLreturn (v);
+}
+
+struct keytable {
+  void **keys;
+  int allocated;
+};
+
+// Sizes of the areas of objects shared under each key of the keytable,
+// so that they can be walked to relocate them.  Files written before
+// this table existed have no sizes, which are then 0.
+#define SIZES_KEY 2
+
+struct sizetable {
+  size_t *sizes;
+  int allocated;
+};
+
+/* Versions.
+ *
+ * Readers never take the lock of the file.  share copies the new
+ * object completely, then swaps it into the keytable with one atomic
+ * store, so get sees either the old object or the new one.  The old
+ * object is retired rather than freed, until no reader can still be
+ * using it.
+ *
+ * Each process reading the file takes a slot in a small table in
+ * POSIX shared memory named after the device and inode of the file,
+ * so that readers which attached read-only can write to it too.  The
+ * first get pins the current epoch in the slot, and release clears
+ * it.  A writer retires an object with the current epoch and then
+ * advances the epoch.  Readers which pin a later epoch look at the
+ * keytable after the swap, so the object is freed once all the
+ * pinned epochs are later.  The slots of dead processes are taken
+ * back.  If the table can't be opened, objects are freed at once, as
+ * before.
+ */
+
+#define RETIRED_KEY 3
 
-  // If we've already visited this object, just return its offset
-  // in the out-of-heap memory.
-  if ( hd == visited )
-    return (Long_val (Field (obj, 0)));
+#define MAX_READERS 256
 
-  int wosize = Wosize_hd (hd);
-  int tag = Tag_hd (hd);
+struct epochs {
+  uint64_t epoch;		// Current epoch.
+  struct {
+    pid_t pid;			// Process using the slot, or 0.
+    uint64_t pinned;		// Epoch pinned + 1, or 0 if none.
+  } readers[MAX_READERS];
+};
 
-  /* block is of size 0, and the corresponding atom was already
-   * allocated, we don't need to do anything */
-  if ( wosize == 0 && atoms[tag] != 0){
-	  return atoms[tag] - ATOM_OFFSET;
-  }
+// Objects replaced in the file, with the epoch they were retired in.
+struct retired {
+  size_t n, allocated;
+  struct {
+    void *ptr;
+    uint64_t epoch;
+  } *items;
+};
 
-  // Offset where we will store this object in the out-of-heap memory.
-  size_t offset = ptr->n;
+// Open the epoch table of the file fd.  Returns 0 if it can't be.
+static struct epochs *
+open_epochs (int fd)
+{
+  struct stat st;
+  char name[64];
+  if (fstat (fd, &st) == -1)
+    return 0;
+  snprintf (name, sizeof name, "/ancient-%llx-%llx",
+	    (unsigned long long) st.st_dev, (unsigned long long) st.st_ino);
+
+  int shm = shm_open (name, O_RDWR | O_CREAT, 0666);
+  if (shm == -1)
+    return 0;
+  // Readers may not be able to create it with other permissions.
+  fchmod (shm, 0666);
+  if (fstat (shm, &st) == -1 ||
+      (st.st_size < (off_t) sizeof (struct epochs) &&
+       ftruncate (shm, sizeof (struct epochs)) == -1)) {
+    close (shm);
+    return 0;
+  }
+  void *e = mmap (0, sizeof (struct epochs), PROT_READ | PROT_WRITE,
+		  MAP_SHARED, shm, 0);
+  close (shm);
+  return e == MAP_FAILED ? 0 : e;
+}
 
-  // Copy the object out of the OCaml heap.
-  size_t bytes = Bhsize_wosize (wosize);
-  if (area_append (ptr, header_ptr, bytes) == -1)
-    return -1;			// Error out of memory.
+static int
+dead (pid_t pid)
+{
+  return kill (pid, 0) == -1 && errno == ESRCH;
+}
 
-  if ( wosize == 0 ){
-	  atoms[tag] = offset + ATOM_OFFSET ;
-	  Hd_hp (ptr->ptr+offset) = Ancient_blackhd_hd (hd);
-	  return offset ;
-  }
-
-  // Scan the fields looking for pointers to blocks.
-  int can_scan = tag < No_scan_tag;
-  if (can_scan) {
-    mlsize_t i;
-
-    for (i = 0; i < wosize; ++i) {
-	    value field = Field (obj, i);
-
-	    if (Is_block (field) && Is_in_value_area (field)){
-		    size_t field_offset =
-			    _mark (field, ptr, restore, fixups);
-		    // Propagate out of memory errors.
-		    if (field_offset == -1) return -1;
-
-		    // Since the recursive call to mark above can
-		    // reallocate the area, we need to recompute these
-		    // each time round the loop.
-		    char *obj_copy_header = ptr->ptr + offset;
-		    value obj_copy = Val_hp (obj_copy_header);
-
-		    // Don't store absolute pointers yet because
-		    // realloc will move the memory around.  Store a
-		    // fake pointer instead.  We'll fix up these fake
-		    // pointers afterwards in do_fixups.
-		    Field (obj_copy, i) =
-			    field_offset + sizeof (header_t);
-
-		    size_t fixup = (void *)&Field(obj_copy, i) - ptr->ptr;
-		    area_append (fixups, &fixup, sizeof fixup);
-	    }
+// Take a free slot, or the slot of a dead process.  Returns -1 if
+// there is none.
+static int
+claim_slot (struct epochs *e)
+{
+  pid_t me = getpid ();
+  int i;
+
+  for (i = 0; i < MAX_READERS; ++i) {
+    pid_t pid = __atomic_load_n (&e->readers[i].pid, __ATOMIC_SEQ_CST);
+    if ((pid == 0 || dead (pid)) &&
+	__atomic_compare_exchange_n (&e->readers[i].pid, &pid, me, 0,
+				     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      __atomic_store_n (&e->readers[i].pinned, 0, __ATOMIC_SEQ_CST);
+      return i;
     }
   }
+  return -1;
+}
 
-  // Mark this object as having been "visited", but keep track of
-  // what was there before so it can be restored.  We also need to
-  // record the offset.
-  // Observations:
-  // (1) What was in the header before is kept in the out-of-heap
-  // copy, so we don't explicitly need to remember that.
-  // (2) We can keep the offset in the zeroth field, but since
-  // the code above might have modified the copy, we need to remember
-  // what was in that field before.
-  // (3) We can overwrite the header with all 1's to indicate that
-  // we've visited (but see notes on 'static header_t visited' above).
-  // (4) All objects in OCaml are at least one word long (XXX - actually
-  // this is not true).
-  struct restore_item restore_item;
-
-  restore_item.header_ptr = header_ptr;
-  restore_item.field_zero = Field (obj, 0);
-  area_append (restore, &restore_item, sizeof restore_item);
+// The epoch table of mdv and the slot of this process in it.  After a
+// fork, the child gets a slot of its own.
+static struct epochs *
+md_epochs (value mdv, int *slot)
+{
+  struct epochs *e = (struct epochs *) Field (mdv, 5);
+  *slot = Int_val (Field (mdv, 6));
+  if (e && *slot >= 0 &&
+      __atomic_load_n (&e->readers[*slot].pid, __ATOMIC_SEQ_CST) != getpid ())
+    *slot = -1;
+  return e;
+}
 
-  Hd_hp (header_ptr) = visited;
-  Field (obj, 0) = Val_long (offset);
+// Pin the current epoch, unless an earlier one is pinned already.
+static void
+pin (value mdv)
+{
+  int slot;
+  struct epochs *e = md_epochs (mdv, &slot);
+  if (e == 0) return;
+  if (slot == -1) {
+    slot = claim_slot (e);
+    if (slot == -1) caml_failwith ("Ancient.get: too many readers");
+    Field (mdv, 6) = Val_int (slot);
+  }
+  if (__atomic_load_n (&e->readers[slot].pinned, __ATOMIC_SEQ_CST) == 0)
+    __atomic_store_n (&e->readers[slot].pinned,
+		      __atomic_load_n (&e->epoch, __ATOMIC_SEQ_CST) + 1,
+		      __ATOMIC_SEQ_CST);
+}
 
-  return offset;
+static void
+unpin (value mdv)
+{
+  int slot;
+  struct epochs *e = md_epochs (mdv, &slot);
+  if (e && slot >= 0)
+    __atomic_store_n (&e->readers[slot].pinned, 0, __ATOMIC_SEQ_CST);
 }
 
-// See comments immediately above.
+// Retire ptr, which was just replaced.  Called with md locked.  If
+// the list of retired objects can't grow, ptr is never freed.
 static void
-do_restore (area *ptr, area *restore)
+retire (void *md, struct epochs *e, void *ptr)
 {
-  mlsize_t i;
-  for (i = 0; i < restore->n; i += sizeof (struct restore_item))
-    {
-      struct restore_item *restore_item =
-	(struct restore_item *)(restore->ptr + i);
+  if (e == 0) {
+    mfree (md, ptr);
+    return;
+  }
+
+  struct retired *r = mmalloc_getkey (md, RETIRED_KEY);
+  if (r == 0) {
+    r = mmalloc (md, sizeof (struct retired));
+    if (r == 0) return;
+    r->n = r->allocated = 0;
+    r->items = 0;
+    mmalloc_setkey (md, RETIRED_KEY, r);
+  }
+  if (r->n == r->allocated) {
+    size_t allocated = r->allocated == 0 ? 16 : r->allocated * 2;
+    void *items = mrealloc (md, r->items, allocated * sizeof r->items[0]);
+    if (items == 0) return;
+    r->items = items;
+    r->allocated = allocated;
+  }
+  r->items[r->n].ptr = ptr;
+  r->items[r->n].epoch = __atomic_fetch_add (&e->epoch, 1, __ATOMIC_SEQ_CST);
+  r->n++;
+}
 
-      assert ( Hd_hp (restore_item->header_ptr) == visited );
+// Free the retired objects which no reader can be using any more.
+// Called with md locked.
+static void
+reclaim (void *md, struct epochs *e)
+{
+  struct retired *r = e ? mmalloc_getkey (md, RETIRED_KEY) : 0;
+  if (r == 0 || r->n == 0) return;
+
+  uint64_t oldest = UINT64_MAX;
+  size_t i, j;
+  for (i = 0; i < MAX_READERS; ++i) {
+    uint64_t pinned = __atomic_load_n (&e->readers[i].pinned,
+				       __ATOMIC_SEQ_CST);
+    if (pinned == 0) continue;
+    pid_t pid = __atomic_load_n (&e->readers[i].pid, __ATOMIC_SEQ_CST);
+    if (pid == 0 || dead (pid)) continue;
+    if (pinned - 1 < oldest) oldest = pinned - 1;
+  }
 
-      value obj = Val_hp (restore_item->header_ptr);
-      size_t offset = Long_val (Field (obj, 0));
+  for (i = j = 0; i < r->n; ++i) {
+    if (r->items[i].epoch < oldest)
+      mfree (md, r->items[i].ptr);
+    else
+      r->items[j++] = r->items[i];
+  }
+  r->n = j;
+}
 
-      char *obj_copy_header = ptr->ptr + offset;
-      //value obj_copy = Val_hp (obj_copy_header);
+// Map in what other writers added to the file, so that the pointers
+// just read from it can be followed.
+static void
+refresh (void *md)
+{
+  int err = mmalloc_refresh (md);
+  if (err != 0) {
+    errno = err;
+    caml_sys_error (NO_ARG);
+  }
+}
 
-      // Restore the original header
-      header_t hd = Hd_hp (obj_copy_header);
-      Hd_hp (restore_item->header_ptr) = hd;
+/* Relocation.
+ *
+ * A file which can't be mapped back where it was created may be mapped
+ * elsewhere, and then all the pointers into it must be moved by the
+ * same delta.  mmalloc relocates its own structures and the keys.  The
+ * tables of this library are relocated explicitly, and the areas of
+ * objects are walked from header to header, using the sizetable, and
+ * the fields which point into the old mapping are moved.  The objects
+ * of old files without sizes are found by following the pointers from
+ * their root instead.
+ */
 
-      // Color the destination header in black
-      Hd_hp (obj_copy_header) = Ancient_blackhd_hd (hd);
+struct relocation {
+  uintnat old;			// Old mapping.
+  size_t size;
+  intnat delta;			// New address - old address.
+  size_t pointers;		// Number of pointers relocated.
+};
 
-      // Restore the original zeroth field.
-      Field (obj, 0) = restore_item->field_zero;
-    }
-}
+#define MOVED(r, ptr) ((void *) ((char *) (ptr) + (r)->delta))
 
-// Fixup fake pointers.
 static void
-do_fixups (area *ptr, area *fixups)
+relocate_fields (struct relocation *r, value *fields, mlsize_t n)
 {
-  long i;
+  uintnat old = r->old;
+  size_t size = r->size;
+  intnat delta = r->delta;
+  size_t pointers = 0;
+  mlsize_t i;
 
-  for (i = 0; i < fixups->n; i += sizeof (size_t))
-    {
-      size_t fixup = *(size_t *)(fixups->ptr + i);
-      size_t offset = *(size_t *)(ptr->ptr + fixup);
-      void *real_ptr = ptr->ptr + offset;
-      *(value *)(ptr->ptr + fixup) = (value) real_ptr;
-    }
+  // No branches, so that the compiler can vectorize the loop.
+  for (i = 0; i < n; ++i) {
+    uintnat f = fields[i];
+    uintnat moved = ((f & 1) == 0) & (f - old < size);
+    fields[i] = f + (delta & - (intnat) moved);
+    pointers += moved;
+  }
+  r->pointers += pointers;
 }
 
-static void *
-mark (value obj,
-      void *(*realloc)(void *data, void *ptr, size_t size),
-      void (*free)(void *data, void *ptr),
-      void *data,
-      size_t *r_size)
+// Relocate the objects in the area [start, start + size).
+static void
+relocate_area (struct relocation *r, char *start, size_t size)
 {
-	int i;
+  char *p = start;
 
-  area ptr; // This will be the out of heap area.
-  area_init_custom (&ptr, realloc, free, data);
-  area restore; // Headers to be fixed up after.
-  area_init (&restore);
-  area fixups; // List of fake pointers to be fixed up.
-  area_init (&fixups);
-
-  /* reset atoms */
-  for (i=0; i<256; i++){
-	  atoms[i] = 0;
-  }
-
-  if (_mark (obj, &ptr, &restore, &fixups) == -1) {
-    // Ran out of memory.  Recover and throw an exception.
-    area_free (&fixups);
-    do_restore (&ptr, &restore);
-    area_free (&restore);
-    area_free (&ptr);
-    caml_failwith ("out of memory");
+  while (p < start + size) {
+    header_t hd = Hd_hp (p);
+    if (Tag_hd (hd) < No_scan_tag)
+      relocate_fields (r, (value *) Val_hp (p), Wosize_hd (hd));
+    p += Bhsize_hd (hd);
   }
-  area_shrink (&ptr);
-
-  // Restore Caml heap structures.
-  do_restore (&ptr, &restore);
-  area_free (&restore);
-
-  // Update all fake pointers in the out of heap area to make them real
-  // pointers.
-  do_fixups (&ptr, &fixups);
-  area_free (&fixups);
+}
 
-  if (r_size) *r_size = ptr.size;
-  return ptr.ptr;
+// Relocate the objects reachable from root, whose size is unknown.
+// Since the old and the new mappings don't overlap, the fields which
+// have been relocated already are told apart from those which have
+// not, so no other record of the objects visited is needed.
+static int
+relocate_graph (struct relocation *r, value root)
+{
+  area stack;
+  area_init (&stack);
+  if (area_append (&stack, &root, sizeof root) == -1)
+    return -1;
+
+  while (stack.n > 0) {
+    stack.n -= sizeof (value);
+    value v = *(value *) (stack.ptr + stack.n);
+    if (Tag_val (v) >= No_scan_tag)
+      continue;
+    mlsize_t i, n = Wosize_val (v);
+    for (i = 0; i < n; ++i) {
+      value f = Field (v, i);
+      if (Is_block (f) && (uintnat) f - r->old < r->size) {
+	f = (value) MOVED (r, f);
+	Field (v, i) = f;
+	r->pointers++;
+	if (area_append (&stack, &f, sizeof f) == -1) {
+	  area_free (&stack);
+	  return -1;
+	}
+      }
+    }
+  }
+  area_free (&stack);
+  return 0;
 }
 
-static void *
-my_realloc (void *data __attribute__((unused)), void *ptr, size_t size)
+// Relocate the tables and the objects of md, which was moved from old.
+static int
+relocate (void *md, void *old, struct relocation *r)
 {
-  return realloc (ptr, size);
+  r->old = (uintnat) old;
+  r->delta = (char *) mmalloc_region (md, &r->size) - (char *) old;
+  r->pointers = 0;
+
+  struct keytable *keytable = mmalloc_getkey (md, 0);
+  struct sizetable *sizetable = mmalloc_getkey (md, SIZES_KEY);
+  struct intern_table *intern = mmalloc_getkey (md, INTERN_KEY);
+  struct retired *retired = mmalloc_getkey (md, RETIRED_KEY);
+  size_t i;
+
+  if (sizetable && sizetable->sizes)
+    sizetable->sizes = MOVED (r, sizetable->sizes);
+  if (keytable && keytable->keys) {
+    keytable->keys = MOVED (r, keytable->keys);
+    for (i = 0; i < (size_t) keytable->allocated; ++i) {
+      char *ptr = keytable->keys[i];
+      if (ptr == 0) continue;
+      keytable->keys[i] = ptr = MOVED (r, ptr);
+      size_t size =
+	sizetable && i < (size_t) sizetable->allocated ? sizetable->sizes[i] : 0;
+      if (size > 0)
+	relocate_area (r, ptr, size);
+      else if (relocate_graph (r, Val_hp (ptr)) == -1)
+	return -1;
+    }
+  }
+  if (intern && intern->slots) {
+    intern->slots = MOVED (r, intern->slots);
+    for (i = 0; i <= intern->mask; ++i)
+      if (intern->slots[i].str)
+	intern->slots[i].str = (value) MOVED (r, intern->slots[i].str);
+  }
+  if (retired && retired->items) {
+    retired->items = MOVED (r, retired->items);
+    for (i = 0; i < retired->n; ++i)
+      retired->items[i].ptr = MOVED (r, retired->items[i].ptr);
+  }
+  return 0;
 }
 
-static void
-my_free (void *data __attribute__((unused)), void *ptr)
+static double
+now (void)
 {
-  return free (ptr);
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-CAMLprim value
-ancient_mark_info (value obj)
+// Attach to fd, and make the memory descriptor handle.
+static value
+attach (int fd, void *baseaddr, int flags, int relocatable)
 {
-  CAMLparam1 (obj);
-  CAMLlocal3 (proxy, info, rv);
+  CAMLparam0 ();
+  CAMLlocal1 (mdv);
 
+  double t0 = now ();
+  void *old = 0;
+  void *md = mmalloc_attach_relocate (fd, baseaddr, flags,
+				      relocatable ? &old : 0);
+  if (md == 0) {
+    perror ("mmalloc_attach");
+    caml_failwith ("mmalloc_attach");
+  }
+
+  struct relocation r = { 0, 0, 0, 0 };
   size_t size;
-  void *ptr = mark (obj, my_realloc, my_free, 0, &size);
+  void *base = mmalloc_region (md, &size);
+  if (relocatable && old != base) {
+    if (relocate (md, old, &r) == -1) {
+      mmalloc_detach (md);
+      caml_failwith ("Ancient.attach: out of memory while relocating");
+    }
+    if (flags & MMALLOC_ATTACH_READONLY)
+      mprotect (base, size, PROT_READ);
+  }
+  else
+    old = 0;
 
-  // Make the proxy.
-  proxy = caml_alloc (1, Abstract_tag);
-  Field (proxy, 0) = (value) ptr;
+  mdv = caml_alloc (7, Abstract_tag);
+  Field (mdv, 0) = (value) md;
+  Field (mdv, 1) = Val_bool (flags & MMALLOC_ATTACH_READONLY);
+  Field (mdv, 2) = (value) old;	// Old base if relocated, else 0.
+  Field (mdv, 3) = Val_long (r.pointers);
+  Field (mdv, 4) = Val_long ((now () - t0) * 1e9); // Nanoseconds.
+  Field (mdv, 5) = (value) open_epochs (fd);	// Epoch table, or 0.
+  Field (mdv, 6) = Val_int (-1);	// Slot in it, taken by get.
 
-  // Make the info struct.
-  info = caml_alloc (1, 0);
-  Field (info, 0) = Val_long (size);
+  CAMLreturn (mdv);
+}
 
-  rv = caml_alloc (2, 0);
-  Field (rv, 0) = proxy;
-  Field (rv, 1) = info;
+CAMLprim value
+ancient_attach (value hugepagesv, value relocatev, value fdv, value baseaddrv)
+{
+  CAMLparam4 (hugepagesv, relocatev, fdv, baseaddrv);
 
-  CAMLreturn (rv);
+  int flags = Bool_val (hugepagesv) ? MMALLOC_ATTACH_HUGEPAGES : 0;
+  CAMLreturn (attach (Int_val (fdv), (void *) Nativeint_val (baseaddrv),
+		      flags, Bool_val (relocatev)));
 }
 
 CAMLprim value
-ancient_follow (value obj)
+ancient_attach_readonly (value relocatev, value fdv)
 {
-  CAMLparam1 (obj);
-  CAMLlocal1 (v);
-
-  v = Field (obj, 0);
-  if (Is_long (v)) caml_invalid_argument ("deleted");
-  v = Val_hp (v); // v points to the header; make it point to the object.
+  CAMLparam2 (relocatev, fdv);
 
-  CAMLreturn (v);
+  CAMLreturn (attach (Int_val (fdv), 0, MMALLOC_ATTACH_READONLY,
+		      Bool_val (relocatev)));
 }
 
 CAMLprim value
-ancient_delete (value obj)
+ancient_relocation (value mdv)
 {
-  CAMLparam1 (obj);
-  CAMLlocal1 (v);
-
-  v = Field (obj, 0);
-  if (Is_long (v)) caml_invalid_argument ("deleted");
+  CAMLparam1 (mdv);
+  CAMLlocal3 (r, v, rv);
 
-  // Otherwise v is a pointer to the out of heap malloc'd object.
-  assert (!Is_in_heap_or_young (v));
-  free ((void *) v);
+  if (Field (mdv, 2) == 0)
+    CAMLreturn (Val_int (0));	// None
 
-  // Replace the proxy (a pointer) with an int 0 so we know it's
-  // been deleted in future.
-  Field (obj, 0) = Val_long (0);
+  size_t size;
+  void *base = mmalloc_region ((void *) Field (mdv, 0), &size);
+  r = caml_alloc (4, 0);
+  v = caml_copy_nativeint ((intnat) Field (mdv, 2));
+  Store_field (r, 0, v);
+  v = caml_copy_nativeint ((intnat) base);
+  Store_field (r, 1, v);
+  Store_field (r, 2, Field (mdv, 3));
+  v = caml_copy_double (Long_val (Field (mdv, 4)) / 1e9);
+  Store_field (r, 3, v);
+
+  rv = caml_alloc (1, 0);	// Some
+  Store_field (rv, 0, r);
 
-  CAMLreturn (Val_unit);
+  CAMLreturn (rv);
 }
 
-CAMLprim value
-ancient_is_ancient (value obj)
+// Get the memory descriptor of mdv, which must not be read-only.
+static void *
+writable_md (value mdv)
 {
-  CAMLparam1 (obj);
-  CAMLlocal1 (v);
-
-  v = Is_in_heap_or_young (obj) ? Val_false : Val_true;
-
-  CAMLreturn (v);
+  if (Bool_val (Field (mdv, 1)))
+    caml_invalid_argument ("Ancient.share: attached read-only");
+  return (void *) Field (mdv, 0);
 }
 
 CAMLprim value
-ancient_address_of (value obj)
+ancient_set_growth (value minv, value percentv)
 {
-  CAMLparam1 (obj);
-  CAMLlocal1 (v);
+  CAMLparam2 (minv, percentv);
 
-  if (Is_block (obj)) v = caml_copy_nativeint ((intnat) obj);
-  else v = caml_copy_nativeint (0);
+  if (Long_val (minv) < 0 || Long_val (percentv) < 0)
+    caml_invalid_argument ("Ancient.set_growth");
+  mmalloc_set_growth (Long_val (minv), Long_val (percentv));
 
-  CAMLreturn (v);
+  CAMLreturn (Val_unit);
 }
 
 CAMLprim value
-ancient_attach (value fdv, value baseaddrv)
+ancient_set_reserve (value sizev)
 {
-  CAMLparam2 (fdv, baseaddrv);
-  CAMLlocal1 (mdv);
-
-  int fd = Int_val (fdv);
-  void *baseaddr = (void *) Nativeint_val (baseaddrv);
-  void *md = mmalloc_attach (fd, baseaddr);
-  if (md == 0) {
-    perror ("mmalloc_attach");
-    caml_failwith ("mmalloc_attach");
-  }
+  CAMLparam1 (sizev);
 
-  mdv = caml_alloc (1, Abstract_tag);
-  Field (mdv, 0) = (value) md;
+  if (Long_val (sizev) < 0)
+    caml_invalid_argument ("Ancient.set_reserve");
+  mmalloc_set_reserve (Long_val (sizev));
 
-  CAMLreturn (mdv);
+  CAMLreturn (Val_unit);
 }
 
 CAMLprim value
@@ -442,6 +2357,17 @@ ancient_detach (value mdv)
   CAMLparam1 (mdv);
 
   void *md = (void *) Field (mdv, 0);
+  int slot;
+  struct epochs *e = md_epochs (mdv, &slot);
+
+  if (e) {
+    if (slot >= 0) {
+      __atomic_store_n (&e->readers[slot].pinned, 0, __ATOMIC_SEQ_CST);
+      __atomic_store_n (&e->readers[slot].pid, 0, __ATOMIC_SEQ_CST);
+    }
+    munmap (e, sizeof (struct epochs));
+    Field (mdv, 5) = 0;
+  }
 
   if (mmalloc_detach (md) != 0) {
     perror ("mmalloc_detach");
@@ -451,61 +2377,265 @@ ancient_detach (value mdv)
   CAMLreturn (Val_unit);
 }
 
-struct keytable {
-  void **keys;
-  int allocated;
+/* Warm up.
+ *
+ * A freshly attached file is faulted in one page at a time by the
+ * first accesses.  Instead, the whole region can be populated ahead of
+ * time: the kernel is told that it will be needed, then several threads
+ * fault in disjoint chunks of it, with MADV_POPULATE_READ where
+ * available and else by reading a byte from each page.  The calling
+ * thread takes chunks too, and reports the progress between them.
+ */
+
+// Size of the chunks which the threads take in turn, bytes.
+#define WARMUP_CHUNK ((size_t) 64 << 20)
+
+struct warmup {
+  char *base;			// Region to warm up.
+  size_t size;
+  size_t next;			// Offset of the next chunk to take.
+  size_t done;			// Bytes populated so far.
+  int stop;			// Set if the progress callback raised.
 };
 
+static void
+populate (char *p, size_t len)
+{
+#ifdef MADV_POPULATE_READ
+  if (madvise (p, len, MADV_POPULATE_READ) == 0)
+    return;
+#endif
+  size_t pagesize = sysconf (_SC_PAGESIZE);
+  size_t i;
+  for (i = 0; i < len; i += pagesize)
+    (void) *(volatile char *) (p + i);
+}
+
+// Populate the next chunk.  Returns 0 if there is none left.
+static int
+warmup_chunk (struct warmup *w)
+{
+  if (__atomic_load_n (&w->stop, __ATOMIC_RELAXED))
+    return 0;
+  size_t offset = __atomic_fetch_add (&w->next, WARMUP_CHUNK,
+				      __ATOMIC_RELAXED);
+  if (offset >= w->size)
+    return 0;
+  size_t len = w->size - offset < WARMUP_CHUNK ? w->size - offset
+					       : WARMUP_CHUNK;
+  populate (w->base + offset, len);
+  __atomic_add_fetch (&w->done, len, __ATOMIC_RELAXED);
+  return 1;
+}
+
+static void *
+warmup_worker (void *vw)
+{
+  struct warmup *w = vw;
+  while (warmup_chunk (w))
+    ;
+  return 0;
+}
+
 CAMLprim value
-ancient_share_info (value mdv, value keyv, value obj)
+ancient_warmup (value threadsv, value progressv, value mdv)
 {
-  CAMLparam3 (mdv, keyv, obj);
-  CAMLlocal3 (proxy, info, rv);
+  CAMLparam3 (threadsv, progressv, mdv);
+  CAMLlocal1 (exn);
+
+  int nr_threads = Int_val (threadsv);
+  if (nr_threads < 1 || nr_threads > MAX_THREADS)
+    caml_invalid_argument ("Ancient.warmup: threads");
+  int has_progress = Is_block (progressv);
+
+  struct warmup w;
+  w.base = mmalloc_region ((void *) Field (mdv, 0), &w.size);
+  w.next = w.done = 0;
+  w.stop = 0;
+
+  // Start reading ahead the whole file while the threads start.
+  madvise (w.base, w.size, MADV_WILLNEED);
+
+  pthread_t threads[MAX_THREADS];
+  int i, nr_started;
+  for (i = 1; i < nr_threads; ++i)
+    if (pthread_create (&threads[i], 0, warmup_worker, &w) != 0)
+      break;
+  nr_started = i;
+
+  while (warmup_chunk (&w)) {
+    if (has_progress) {
+      size_t done = __atomic_load_n (&w.done, __ATOMIC_RELAXED);
+      value r = caml_callback2_exn (Field (progressv, 0),
+				    Val_long (done), Val_long (w.size));
+      if (Is_exception_result (r)) {
+	exn = Extract_exception (r);
+	__atomic_store_n (&w.stop, 1, __ATOMIC_RELAXED);
+      }
+    }
+  }
 
-  void *md = (void *) Field (mdv, 0);
-  int key = Int_val (keyv);
+  for (i = 1; i < nr_started; ++i)
+    pthread_join (threads[i], 0);
+
+  if (w.stop)
+    caml_raise (exn);
+  if (has_progress)
+    caml_callback2 (Field (progressv, 0),
+		    Val_long (w.done), Val_long (w.size));
+
+  CAMLreturn (Val_unit);
+}
 
+// Get the key table, and make room for [key].  The object shared
+// under [key] before stays there until the new one replaces it.
+// Called with md locked, so it returns -1 on failure rather than
+// raising.
+static int
+prepare_key (void *md, struct epochs *e, int key)
+{
   // Get the key table.
   struct keytable *keytable = mmalloc_getkey (md, 0);
   if (keytable == 0) {
     keytable = mmalloc (md, sizeof (struct keytable));
-    if (keytable == 0) caml_failwith ("out of memory");
+    if (keytable == 0) return -1;
     keytable->keys = 0;
     keytable->allocated = 0;
     mmalloc_setkey (md, 0, keytable);
   }
 
-  // Existing key exists?  Free it.
-  if (key < keytable->allocated && keytable->keys[key] != 0) {
-    mfree (md, keytable->keys[key]);
-    keytable->keys[key] = 0;
-  }
-
-  // Keytable large enough?  If not, realloc it.
+  // Keytable large enough?  If not, copy it to a larger one, which
+  // readers see once it is complete, and retire the old one.
   if (key >= keytable->allocated) {
     int allocated = keytable->allocated == 0 ? 32 : keytable->allocated * 2;
-    void **keys = mrealloc (md, keytable->keys, allocated * sizeof (void *));
-    if (keys == 0) caml_failwith ("out of memory");
+    while (key >= allocated) allocated *= 2;
+    void **keys = mmalloc (md, allocated * sizeof (void *));
+    if (keys == 0) return -1;
+    void **old = keytable->keys;
     int i;
-    for (i = keytable->allocated; i < allocated; ++i) keys[i] = 0;
-    keytable->keys = keys;
-    keytable->allocated = allocated;
+    for (i = 0; i < keytable->allocated; ++i) keys[i] = old[i];
+    for (; i < allocated; ++i) keys[i] = 0;
+    __atomic_store_n (&keytable->keys, keys, __ATOMIC_RELEASE);
+    __atomic_store_n (&keytable->allocated, allocated, __ATOMIC_RELEASE);
+    if (old) retire (md, e, old);
   }
 
+  // Same for the sizetable, which only writers use.
+  struct sizetable *sizetable = mmalloc_getkey (md, SIZES_KEY);
+  if (sizetable == 0) {
+    sizetable = mmalloc (md, sizeof (struct sizetable));
+    if (sizetable == 0) return -1;
+    sizetable->sizes = 0;
+    sizetable->allocated = 0;
+    mmalloc_setkey (md, SIZES_KEY, sizetable);
+  }
+  if (sizetable->allocated < keytable->allocated) {
+    int allocated = keytable->allocated;
+    size_t *sizes =
+      mrealloc (md, sizetable->sizes, allocated * sizeof (size_t));
+    if (sizes == 0) return -1;
+    int i;
+    for (i = sizetable->allocated; i < allocated; ++i) sizes[i] = 0;
+    sizetable->sizes = sizes;
+    sizetable->allocated = allocated;
+  }
+
+  return 0;
+}
+
+// Lock md against other writers, in this process or others.
+static void
+lock_md (void *md)
+{
+  if (mmalloc_lock (md) != 0) alloc_failed (md);
+}
+
+// Make room for key in the tables, before marking.
+static void
+reserve_key (void *md, struct epochs *e, int key)
+{
+  lock_md (md);
+  int r = prepare_key (md, e, key);
+  mmalloc_unlock (md);
+  if (r == -1) alloc_failed (md);
+}
+
+// Publish the object at ptr, of used bytes, under key, and retire the
+// object it replaces.  Another writer may have shared something under
+// the same key while we were marking: the last one wins.  The tables
+// are looked up again because other writers may have grown them.
+static void
+set_key (void *md, struct epochs *e, int key, void *ptr, size_t used)
+{
+  lock_md (md);
+  struct keytable *keytable = mmalloc_getkey (md, 0);
+  struct sizetable *sizetable = mmalloc_getkey (md, SIZES_KEY);
+
+  void *old = __atomic_exchange_n (&keytable->keys[key], ptr,
+				   __ATOMIC_SEQ_CST);
+  sizetable->sizes[key] = used;
+  if (old) retire (md, e, old);
+  reclaim (md, e);
+  mmalloc_unlock (md);
+}
+
+CAMLprim value
+ancient_share_info (value flagsv, value mdv, value keyv, value obj)
+{
+  CAMLparam4 (flagsv, mdv, keyv, obj);
+  CAMLlocal3 (proxy, info, rv);
+
+  void *md = writable_md (mdv);
+  struct epochs *e = (struct epochs *) Field (mdv, 5);
+  int key = Int_val (keyv);
+  reserve_key (md, e, key);
+
   // Do the mark.
-  size_t size;
-  void *ptr = mark (obj, mrealloc, mfree, md, &size);
+  struct mark_info mark_info;
+  void *ptr = mark (obj, Int_val (flagsv), mrealloc, mfree, md, &mark_info);
+
+  // Add the key to the keytable.
+  set_key (md, e, key, ptr, mark_info.used);
+
+  // Make the proxy.
+  proxy = caml_alloc (1, Abstract_tag);
+  Field (proxy, 0) = (value) ptr;
+
+  // Make the info struct.
+  info = alloc_info (&mark_info);
+
+  rv = caml_alloc (2, 0);
+  Field (rv, 0) = proxy;
+  Field (rv, 1) = info;
+
+  CAMLreturn (rv);
+}
+
+CAMLprim value
+ancient_share_parallel_info (value threadsv, value mdv, value keyv, value obj)
+{
+  CAMLparam4 (threadsv, mdv, keyv, obj);
+  CAMLlocal3 (proxy, info, rv);
+
+  void *md = writable_md (mdv);
+  struct epochs *e = (struct epochs *) Field (mdv, 5);
+  int key = Int_val (keyv);
+  reserve_key (md, e, key);
+
+  // Do the mark.  Only the calling thread allocates from md.
+  struct mark_info mark_info;
+  void *ptr = mark_parallel (obj, Int_val (threadsv),
+			     mrealloc, mfree, md, &mark_info);
 
   // Add the key to the keytable.
-  keytable->keys[key] = ptr;
+  set_key (md, e, key, ptr, mark_info.used);
 
   // Make the proxy.
   proxy = caml_alloc (1, Abstract_tag);
   Field (proxy, 0) = (value) ptr;
 
   // Make the info struct.
-  info = caml_alloc (1, 0);
-  Field (info, 0) = Val_long (size);
+  info = alloc_info (&mark_info);
 
   rv = caml_alloc (2, 0);
   Field (rv, 0) = proxy;
@@ -514,6 +2644,29 @@ ancient_share_info (value mdv, value keyv, value obj)
   CAMLreturn (rv);
 }
 
+CAMLprim value
+ancient_share_many (value mdv, value keyv, value roots)
+{
+  CAMLparam3 (mdv, keyv, roots);
+  CAMLlocal1 (proxies);
+
+  void *md = writable_md (mdv);
+  struct epochs *e = (struct epochs *) Field (mdv, 5);
+  int key = Int_val (keyv);
+  reserve_key (md, e, key);
+
+  // Do the mark.
+  struct mark_info mark_info;
+  void *ptr = mark (roots, 0, mrealloc, mfree, md, &mark_info);
+
+  // Add the key to the keytable.
+  set_key (md, e, key, ptr, mark_info.used);
+
+  proxies = alloc_batch (ptr, batch_length (roots));
+
+  CAMLreturn (proxies);
+}
+
 CAMLprim value
 ancient_get (value mdv, value keyv)
 {
@@ -523,11 +2676,27 @@ ancient_get (value mdv, value keyv)
   void *md = (void *) Field (mdv, 0);
   int key = Int_val (keyv);
 
+  // Pin the epoch before looking at the keytable, so that what we
+  // find there is not freed until release.  Each pointer read from
+  // the file may be to memory another writer added since we last
+  // looked, so that is mapped in before the pointer is followed.
+  pin (mdv);
+
   // Key exists?
   struct keytable *keytable = mmalloc_getkey (md, 0);
-  if (keytable == 0 || key >= keytable->allocated || keytable->keys[key] == 0)
+  void *ptr = 0;
+  if (keytable != 0) {
+    refresh (md);
+    int allocated = __atomic_load_n (&keytable->allocated, __ATOMIC_ACQUIRE);
+    void **keys = __atomic_load_n (&keytable->keys, __ATOMIC_ACQUIRE);
+    if (key < allocated) {
+      refresh (md);
+      ptr = __atomic_load_n (&keys[key], __ATOMIC_SEQ_CST);
+      refresh (md);
+    }
+  }
+  if (ptr == 0)
     caml_raise_not_found ();
-  void *ptr = keytable->keys[key];
 
   // Return the proxy.
   proxy = caml_alloc (1, Abstract_tag);
@@ -535,3 +2704,13 @@ ancient_get (value mdv, value keyv)
 
   CAMLreturn (proxy);
 }
+
+CAMLprim value
+ancient_release (value mdv)
+{
+  CAMLparam1 (mdv);
+
+  unpin (mdv);
+
+  CAMLreturn (Val_unit);
+}
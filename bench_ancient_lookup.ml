@@ -0,0 +1,76 @@
+(* Compare random lookup throughput in a large ancient object, with
+ * and without huge pages.
+ * Usage: bench_ancient_lookup.opt [nr_objects [file]]
+ * If [file] is given, the object is also shared in that file (which
+ * is truncated).  Put it on a tmpfs mounted with huge=always or on
+ * hugetlbfs to get huge pages for the shared mapping.
+ *)
+
+open Printf
+
+type entry = {
+  key : int;
+  value : string;
+}
+
+let nr_lookups = 10_000_000
+
+(* Look up random entries, following a pointer from the array to the
+ * record and another to the string, so each lookup touches pages far
+ * apart from each other.
+ *)
+let lookups (a : entry array) =
+  let n = Array.length a in
+  let sum = ref 0 in
+  let seed = ref 42 in
+  for _ = 1 to nr_lookups do
+    seed := (!seed * 1103515245 + 12345) land 0x3fff_ffff;
+    let e = Array.unsafe_get a (!seed mod n) in
+    sum := !sum + e.key + String.length e.value
+  done;
+  !sum
+
+let () =
+  let n = if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1)
+	  else 5_000_000 in
+  let file = if Array.length Sys.argv > 2 then Some Sys.argv.(2) else None in
+
+  let a = Array.init n (fun i -> { key = i; value = string_of_int i }) in
+  Gc.compact ();
+
+  let time name f =
+    let t0 = Unix.gettimeofday () in
+    let r = f () in
+    let t = Unix.gettimeofday () -. t0 in
+    printf "%-24s %8.3f s  %6.2f M lookups/s\n%!"
+      name t (float nr_lookups /. t /. 1e6);
+    r
+  in
+
+  let expected = time "heap:" (fun () -> lookups a) in
+
+  let check name a =
+    let r = time name (fun () -> lookups (Ancient.follow a)) in
+    assert (r = expected)
+  in
+
+  List.iter (
+    fun hugepages ->
+      let name = sprintf "mark ~hugepages:%b:" hugepages in
+      let ancient = Ancient.mark ~hugepages a in
+      check name ancient;
+      Ancient.delete ancient
+  ) [false; true];
+
+  match file with
+  | None -> ()
+  | Some file ->
+    List.iter (
+      fun hugepages ->
+	let fd = Unix.openfile file [Unix.O_RDWR; Unix.O_TRUNC; Unix.O_CREAT]
+	  0o644 in
+	let md = Ancient.attach ~hugepages fd 0x440000000000n in
+	let name = sprintf "share ~hugepages:%b:" hugepages in
+	check name (Ancient.share md 0 a);
+	Ancient.detach md
+    ) [false; true]
@@ -0,0 +1,53 @@
+(* Time Ancient.mark_parallel with increasing numbers of threads.
+ * Usage: bench_ancient_mark.opt [nr_objects [max_threads]]
+ *)
+
+open Printf
+
+type node = {
+  id : int;
+  name : string;
+  children : node list;
+}
+
+(* A tree of records with [n] leaves, about 3 blocks per node. *)
+let rec make_tree depth n =
+  if n <= 1 || depth = 0 then
+    { id = n; name = string_of_int n; children = [] }
+  else (
+    let k = 8 in
+    let children = List.init k (fun i -> make_tree (depth-1) ((n + i) / k)) in
+    { id = n; name = string_of_int n; children = children }
+  )
+
+let () =
+  let n = if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1)
+	  else 10_000_000 in
+  let max_threads = if Array.length Sys.argv > 2
+		    then int_of_string Sys.argv.(2) else 8 in
+
+  let tree = make_tree 20 n in
+  Gc.compact ();
+
+  let time f =
+    let t0 = Unix.gettimeofday () in
+    let r = f () in
+    r, Unix.gettimeofday () -. t0
+  in
+
+  let a, t = time (fun () -> Ancient.mark tree) in
+  Ancient.delete a;
+  printf "mark:                  %8.3f s\n%!" t;
+
+  let rec loop threads t1 =
+    if threads <= max_threads then (
+      let (a, info), t =
+	time (fun () -> Ancient.mark_parallel_info ~threads tree) in
+      Ancient.delete a;
+      let t1 = if threads = 1 then t else t1 in
+      printf "mark_parallel %3d:     %8.3f s  speedup %.2f  temp %d MB\n%!"
+	threads t (t1 /. t) (info.Ancient.i_temp_size / 1024 / 1024);
+      loop (threads * 2) t1
+    )
+  in
+  loop 1 0.
@@ -0,0 +1,65 @@
+(* Time small Ancient.share calls from increasing numbers of writer
+ * processes sharing the same file, to see how allocation from the
+ * region scales.
+ * Usage: bench_ancient_share.opt [nr_shares [max_writers [file]]]
+ *)
+
+open Printf
+
+let base = 0x440000000000n
+
+(* Each writer cycles through this many keys of its own, so that every
+ * share after the first round frees the value it replaces.
+ *)
+let nr_keys = 1000
+
+let writer file w n =
+  let fd = Unix.openfile file [Unix.O_RDWR] 0o644 in
+  let md = Ancient.attach fd base in
+  for i = 0 to n-1 do
+    let key = 1 + w * nr_keys + i mod nr_keys in
+    ignore (Ancient.share md key (i, string_of_int i))
+  done;
+  Ancient.detach md;
+  Unix.close fd
+
+let () =
+  let n = if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1)
+	  else 1_000_000 in
+  let max_writers = if Array.length Sys.argv > 2
+		    then int_of_string Sys.argv.(2) else 8 in
+  let file = if Array.length Sys.argv > 3 then Sys.argv.(3)
+	     else Filename.concat (Filename.get_temp_dir_name ())
+		    "bench_ancient_share.data" in
+
+  let time f =
+    let t0 = Unix.gettimeofday () in
+    f ();
+    Unix.gettimeofday () -. t0
+  in
+
+  let rec loop writers t1 =
+    if writers <= max_writers then (
+      let fd = Unix.openfile file [Unix.O_RDWR; Unix.O_TRUNC; Unix.O_CREAT]
+	0o644 in
+      let md = Ancient.attach fd base in
+      ignore (Ancient.share md 0 ());
+      let t = time (fun () ->
+	let pids = List.init writers (fun w ->
+	  match Unix.fork () with
+	  | 0 -> writer file w n; exit 0
+	  | pid -> pid
+	) in
+	List.iter (fun pid -> ignore (Unix.waitpid [] pid)) pids
+      ) in
+      Ancient.detach md;
+      Unix.close fd;
+      let t1 = if writers = 1 then t else t1 in
+      printf "share %3d writers:     %8.3f s  %6.2f M shares/s  speedup %.2f\n%!"
+	writers t (float (writers * n) /. t /. 1e6)
+	(float writers *. t1 /. t);
+      loop (writers * 2) t1
+    )
+  in
+  loop 1 0.;
+  Unix.unlink file
@@ -0,0 +1,72 @@
+(* Share many small objects of various sizes, each under its own key,
+ * and report how many bytes the file grows by for each byte of the
+ * objects, beyond the objects themselves.  For comparison, also print
+ * what rounding each object up to a power of two, as fragments used to
+ * be, would waste by itself.
+ * Usage: bench_ancient_waste.opt [nr_objects [file]]
+ *)
+
+open Printf
+
+(* Fragments are at most half a block; larger objects get whole blocks. *)
+let block_size = 4096
+
+let pow2_size size =
+  if size > block_size / 2 then
+    (size + block_size - 1) / block_size * block_size
+  else (
+    let rec loop p = if p >= size then p else loop (p * 2) in
+    loop 16
+  )
+
+let cases = [
+  "strings of 0-2000 bytes",
+  (fun i -> Obj.repr (String.make (i * 7919 mod 2001) 'x'));
+  "strings of 0-120 bytes",
+  (fun i -> Obj.repr (String.make (i * 7919 mod 121) 'x'));
+  "strings of 1080 bytes",
+  (fun _ -> Obj.repr (String.make 1080 'x'));
+  "pairs (int, string)",
+  (fun i -> Obj.repr (i, string_of_int i));
+  "int arrays of 1-64",
+  (fun i -> Obj.repr (Array.make (1 + i * 7919 mod 64) i));
+]
+
+let () =
+  let n = if Array.length Sys.argv > 1 then int_of_string Sys.argv.(1)
+	  else 200_000 in
+  let file = if Array.length Sys.argv > 2 then Sys.argv.(2)
+	     else Filename.concat (Filename.get_temp_dir_name ())
+		    "bench_ancient_waste.data" in
+
+  (* Grow the file only as far as needed, so that its size shows what
+   * the allocator used.
+   *)
+  Ancient.set_growth ~min:0 ~percent:0;
+
+  List.iter (
+    fun (name, make) ->
+      let fd = Unix.openfile file [Unix.O_RDWR; Unix.O_TRUNC; Unix.O_CREAT]
+	0o644 in
+      let md = Ancient.attach fd 0n in
+      (* Sharing the last key first makes the key table as large as it
+       * will get, so that it doesn't count.
+       *)
+      ignore (Ancient.share md (n-1) ());
+      let size0 = (Unix.fstat fd).Unix.st_size in
+      let live = ref 0 and pow2 = ref 0 in
+      for i = 0 to n-2 do
+	let _, info = Ancient.share_info md i (make i) in
+	live := !live + info.Ancient.i_size;
+	pow2 := !pow2 + pow2_size info.Ancient.i_size
+      done;
+      let used = (Unix.fstat fd).Unix.st_size - size0 in
+      Ancient.detach md;
+      Unix.close fd;
+      printf "%-24s %8.1f MB live  wasted per live byte: %.3f  \
+	      (powers of two: %.3f)\n%!"
+	name (float !live /. 1e6)
+	(float (used - !live) /. float !live)
+	(float (!pow2 - !live) /. float !live)
+  ) cases;
+  Unix.unlink file
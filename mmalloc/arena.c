@@ -0,0 +1,884 @@
+/* Sub-arenas of mmap'd malloc managed regions.
+
+This file is part of the GNU C Library.
+
+The GNU C Library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Library General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The GNU C Library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Library General Public
+License along with the GNU C Library; see the file COPYING.LIB.  If
+not, write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+Boston, MA 02111-1307, USA.  */
+
+/* Writers sharing a region would all take turns with its lock just to
+   take fragments off the free lists and to put them back.  Instead, the
+   fragments of a region with MMALLOC_ARENAS come from MMALLOC_NARENAS
+   arenas in the malloc descriptor, each with its own lock and its own
+   fragment lists.  Each thread claims an arena for itself, if one is
+   free, and takes the lock of the region only to get whole blocks to cut
+   into fragments.  A freed fragment goes back to the arena its block was
+   cut for, which the heapinfo table records, and a block whose fragments
+   are all free goes back to the region.
+
+   The lock of the region may be held when the lock of an arena is
+   taken, but not the other way round.  The heapinfo table, or the nodes
+   of its tree, are only moved with the lock of the region and those of
+   all the arenas held, so they stay put while any arena is locked.
+
+   On top of that, each thread keeps up to CACHE_SIZE free fragments of
+   each size class for the region it last used, so that most calls to mmalloc
+   and mfree take no lock at all.  The cache is filled from the arena,
+   and given back to it, CACHE_BATCH fragments at a time, with a single
+   lock each time.  The fragments in caches count as used in the arenas.
+   A thread gives its cache back when it exits or detaches the region,
+   and only caches fragments of another region once it is empty.  A
+   cache for a region which another thread detached, or inherited by the
+   child of a fork, whose parent may hand out the same fragments, is
+   dropped instead.
+
+   The fragments of these regions are not rounded up to a power of two,
+   which wastes up to half of each one, but to one of MMALLOC_NCLASSES
+   size classes: multiples of 16 bytes up to 64, then four steps for
+   each power of two up to BLOCKSIZE / 2.  The type of a fragmented
+   block in the heapinfo table is the class of its fragments, and a
+   block holds as many of them as fit, with what is left at its end
+   unused.  */
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <sys/syscall.h>
+#include "mmprivate.h"
+
+/* Number of bytes an arena gets from the region at a time, in as many
+   blocks as that takes, or in one larger block.  */
+
+#define ARENA_REFILL	((size_t) 4 << MMALLOC_BLOCKLOG)
+
+/* Number of fragments of each size cached by a thread, and moved
+   between the cache and the arena at a time.  */
+
+#define CACHE_SIZE	32
+#define CACHE_BATCH	(CACHE_SIZE / 2)
+
+/* Size classes which are cached: those of regions with the default
+   block size.  The larger fragments of regions with larger blocks are
+   not worth keeping idle in every thread.  */
+
+#define CACHE_CLASSES	(4 * (MMALLOC_BLOCKLOG - 6))
+
+struct cache
+  {
+    struct mdesc *mdp;		/* Region of the fragments, or NULL.  */
+    PTR base;			/* Its base address.  */
+    unsigned long serial;	/* See __mmalloc_serial.  */
+    unsigned long untracked;	/* __mmalloc_untracked when last checked.  */
+    int count[CACHE_CLASSES + 1];
+    PTR frags[CACHE_CLASSES + 1][CACHE_SIZE];
+  };
+
+/* The ID of this thread, 0 until known and again in the child of a
+   fork.  */
+
+static __thread pid_t this_thread;
+
+/* The region this thread last allocated from, and its arena there.  If
+   SHARED_ARENA, the arena belongs to another thread.  */
+
+static __thread struct mdesc *last_mdp;
+static __thread int last_arena;
+static __thread int shared_arena;
+
+static __thread struct cache cache;
+
+/* Gives the cache back when its thread exits.  */
+
+static pthread_key_t cache_key;
+
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static void flush_cache PARAMS ((void));
+
+static void
+forget_thread ()
+{
+  this_thread = 0;
+  last_mdp = NULL;
+  memset (&cache, 0, sizeof (cache));
+}
+
+static void
+flush_at_exit (arg)
+  PTR arg;
+{
+  flush_cache ();
+}
+
+static void
+register_atfork ()
+{
+  pthread_atfork (NULL, NULL, forget_thread);
+  pthread_key_create (&cache_key, flush_at_exit);
+}
+
+static pid_t
+thread_id ()
+{
+  if (this_thread == 0)
+    {
+      pthread_once (&atfork_once, register_atfork);
+#ifdef SYS_gettid
+      this_thread = (pid_t) syscall (SYS_gettid);
+#else
+      this_thread = getpid ();
+#endif
+    }
+  return (this_thread);
+}
+
+static int
+thread_dead (tid)
+  pid_t tid;
+{
+  return (kill (tid, 0) == -1 && errno == ESRCH);
+}
+
+/* Return the size of the fragments of size class C.  */
+
+static size_t
+class_size (c)
+  int c;
+{
+  int k;
+
+  if (c <= 4)
+    {
+      return ((size_t) c * 16);
+    }
+  k = (c - 5) / 4;
+  return (((size_t) 64 << k) + (size_t) ((c - 5) % 4 + 1) * (16 << k));
+}
+
+/* Return the smallest size class with fragments of at least SIZE
+   bytes, for 0 < SIZE <= BLOCKSIZE / 2.  */
+
+static int
+class_of (size)
+  size_t size;
+{
+  int k;
+
+  if (size <= 64)
+    {
+      return ((int) (size + 15) / 16);
+    }
+  k = (int) (CHAR_BIT * sizeof (long)) - 1 - __builtin_clzl (size - 1) - 6;
+  return (5 + 4 * k + (int) ((size - 1 - ((size_t) 64 << k)) / (16 << k)));
+}
+
+size_t
+__mmalloc_fragment_size (mdp, type)
+  struct mdesc *mdp;
+  int type;
+{
+  if (mdp -> flags & MMALLOC_ARENAS)
+    {
+      return (class_size (type));
+    }
+  return ((size_t) 1 << type);
+}
+
+static int
+lock_arena (a)
+  struct arena *a;
+{
+  int result = pthread_mutex_lock (&a -> lock);
+
+  if (result == EOWNERDEAD)
+    {
+      /* As with the lock of the region, see mmalloc_lock. */
+      result = pthread_mutex_consistent (&a -> lock);
+    }
+  return (result);
+}
+
+int
+__mmalloc_init_arenas (mdp)
+  struct mdesc *mdp;
+{
+  pthread_mutexattr_t attr;
+  int result;
+  int i;
+
+  if ((result = pthread_mutexattr_init (&attr)) != 0)
+    {
+      return (result);
+    }
+  if ((result = pthread_mutexattr_setpshared (&attr,
+					      PTHREAD_PROCESS_SHARED)) == 0 &&
+      (result = pthread_mutexattr_setrobust (&attr,
+					     PTHREAD_MUTEX_ROBUST)) == 0)
+    {
+      for (i = 0; i < MMALLOC_NARENAS; i++)
+	{
+	  if ((result = pthread_mutex_init (&mdp -> arenas[i].lock,
+					    &attr)) != 0)
+	    {
+	      break;
+	    }
+	}
+    }
+  if (result == 0)
+    {
+      mdp -> flags |= MMALLOC_ARENAS;
+    }
+  pthread_mutexattr_destroy (&attr);
+  return (result);
+}
+
+/* Return the arena of this thread in MDP, claiming a free one, or one
+   whose thread has died, the first time.  If they are all taken, the
+   thread shares one with others. */
+
+static int
+find_arena (mdp)
+  struct mdesc *mdp;
+{
+  pid_t me = thread_id ();
+  pid_t owner;
+  int i;
+
+  if (last_mdp == mdp &&
+      (shared_arena ||
+       __atomic_load_n (&mdp -> arenas[last_arena].owner,
+			__ATOMIC_RELAXED) == me))
+    {
+      return (last_arena);
+    }
+  shared_arena = 0;
+  for (i = 0; i < MMALLOC_NARENAS; i++)
+    {
+      if (__atomic_load_n (&mdp -> arenas[i].owner, __ATOMIC_RELAXED) == me)
+	{
+	  goto found;
+	}
+    }
+  for (i = 0; i < MMALLOC_NARENAS; i++)
+    {
+      owner = __atomic_load_n (&mdp -> arenas[i].owner, __ATOMIC_RELAXED);
+      if ((owner == 0 || thread_dead (owner)) &&
+	  __atomic_compare_exchange_n (&mdp -> arenas[i].owner, &owner, me,
+				       0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+	{
+	  goto found;
+	}
+    }
+  i = me % MMALLOC_NARENAS;
+  shared_arena = 1;
+ found:
+  last_mdp = mdp;
+  last_arena = i;
+  return (i);
+}
+
+void
+__mmalloc_release_arena (mdp)
+  struct mdesc *mdp;
+{
+  pid_t me = thread_id ();
+  pid_t owner;
+  int i;
+
+  if (!(mdp -> flags & MMALLOC_ARENAS))
+    {
+      return;
+    }
+  if (cache.mdp == mdp)
+    {
+      flush_cache ();
+    }
+  for (i = 0; i < MMALLOC_NARENAS; i++)
+    {
+      owner = me;
+      __atomic_compare_exchange_n (&mdp -> arenas[i].owner, &owner, 0,
+				   0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+  if (last_mdp == mdp)
+    {
+      last_mdp = NULL;
+    }
+}
+
+void
+__mmalloc_lock_arenas (mdp)
+  struct mdesc *mdp;
+{
+  int i;
+
+  if (mdp -> flags & MMALLOC_ARENAS)
+    {
+      for (i = 0; i < MMALLOC_NARENAS; i++)
+	{
+	  lock_arena (&mdp -> arenas[i]);
+	}
+    }
+}
+
+void
+__mmalloc_unlock_arenas (mdp)
+  struct mdesc *mdp;
+{
+  int i;
+
+  if (mdp -> flags & MMALLOC_ARENAS)
+    {
+      for (i = MMALLOC_NARENAS - 1; i >= 0; i--)
+	{
+	  pthread_mutex_unlock (&mdp -> arenas[i].lock);
+	}
+    }
+}
+
+/* Get up to ARENA_REFILL bytes of blocks from the region, cut them into fragments
+   of size class C, and put these on the list of arena I.  Returns 0 with
+   the arena locked, or -1. */
+
+static int
+refill (mdp, i, c)
+  struct mdesc *mdp;
+  int i;
+  int c;
+{
+  struct arena *a = &mdp -> arenas[i];
+  size_t size = class_size (c);
+  size_t nfrags = BLOCKSIZE / size;
+  PTR blocks[ARENA_REFILL >> MMALLOC_BLOCKLOG];
+  int nblocks = ARENA_REFILL > BLOCKSIZE ? ARENA_REFILL / BLOCKSIZE : 1;
+  struct list *next;
+  size_t block;
+  size_t j;
+  int n, k;
+
+  if (mmalloc_lock ((PTR) mdp) != 0)
+    {
+      return (-1);
+    }
+  for (n = 0; n < nblocks; n++)
+    {
+      if ((blocks[n] = mmalloc ((PTR) mdp, BLOCKSIZE)) == NULL)
+	{
+	  break;
+	}
+    }
+  if (n == 0 || lock_arena (a) != 0)
+    {
+      for (k = 0; k < n; k++)
+	{
+	  mfree ((PTR) mdp, blocks[k]);
+	}
+      mmalloc_unlock ((PTR) mdp);
+      return (-1);
+    }
+
+  for (k = 0; k < n; k++)
+    {
+      /* Link all the fragments of the block together into the list.  */
+      for (j = 0; j < nfrags; ++j)
+	{
+	  next = (struct list *) ((char *) blocks[k] + j * size);
+	  next -> next = a -> fraghead[c].next;
+	  next -> prev = &a -> fraghead[c];
+	  next -> prev -> next = next;
+	  if (next -> next != NULL)
+	    {
+	      next -> next -> prev = next;
+	    }
+	}
+
+      block = BLOCK (blocks[k]);
+      HEAPINFO (block).busy.type = c;
+      HEAPINFO (block).busy.arena = i;
+      HEAPINFO (block).busy.info.frag.nfree = j;
+      HEAPINFO (block).busy.info.frag.first = j - 1;
+
+      /* What is left at the end of the block stays used.  */
+      a -> stats.chunks_used--;
+      a -> stats.bytes_used -= nfrags * size;
+      a -> stats.chunks_free += nfrags;
+      a -> stats.bytes_free += nfrags * size;
+    }
+  mmalloc_unlock ((PTR) mdp);
+  return (0);
+}
+
+/* Take up to N fragments of size class C off the list of the arena of
+   this thread into FRAGS, getting blocks from the region if the list is
+   empty.  Returns how many, 0 if none could be had.  */
+
+static int
+take (mdp, c, frags, n)
+  struct mdesc *mdp;
+  int c;
+  PTR *frags;
+  int n;
+{
+  struct arena *a;
+  size_t size = class_size (c);
+  struct list *next;
+  size_t block;
+  int i, k;
+
+  i = find_arena (mdp);
+  a = &mdp -> arenas[i];
+  if (lock_arena (a) != 0)
+    {
+      return (0);
+    }
+  /* Another process may have cut the fragments, or moved the heapinfo
+     table, past what this one has mapped. */
+  if (mmalloc_refresh ((PTR) mdp) != 0)
+    {
+      pthread_mutex_unlock (&a -> lock);
+      return (0);
+    }
+  for (k = 0; k < n; k++)
+    {
+      while ((next = a -> fraghead[c].next) == NULL)
+	{
+	  if (k > 0)
+	    {
+	      goto done;
+	    }
+	  pthread_mutex_unlock (&a -> lock);
+	  if (refill (mdp, i, c) != 0)
+	    {
+	      return (0);
+	    }
+	}
+
+      /* Pop a fragment out of the fragment list, as mmalloc does.  */
+      next -> prev -> next = next -> next;
+      if (next -> next != NULL)
+	{
+	  next -> next -> prev = next -> prev;
+	}
+      block = BLOCK (next);
+      if (--HEAPINFO (block).busy.info.frag.nfree != 0)
+	{
+	  HEAPINFO (block).busy.info.frag.first =
+	    RESIDUAL (next -> next, BLOCKSIZE) / size;
+	}
+
+      a -> stats.chunks_used++;
+      a -> stats.bytes_used += size;
+      a -> stats.chunks_free--;
+      a -> stats.bytes_free -= size;
+
+      frags[k] = (PTR) next;
+    }
+ done:
+  pthread_mutex_unlock (&a -> lock);
+  return (k);
+}
+
+/* Put the fragment PTR of BLOCK, of size class TYPE, back in arena I,
+   which is locked, as __mmalloc_free does.  If all the fragments of the
+   block are now free, returns the block, to be given back to the region
+   once the arena is unlocked; otherwise returns NULL.  */
+
+static PTR
+free_fragment (mdp, i, ptr, block, type)
+  struct mdesc *mdp;
+  int i;
+  PTR ptr;
+  size_t block;
+  int type;
+{
+  struct arena *a = &mdp -> arenas[i];
+  size_t size = class_size (type);
+  size_t nfrags = BLOCKSIZE / size;
+  struct list *prev, *next;
+  size_t j;
+
+  a -> stats.chunks_used--;
+  a -> stats.bytes_used -= size;
+  a -> stats.chunks_free++;
+  a -> stats.bytes_free += size;
+
+  /* Get the address of the first free fragment in this block.  */
+  prev = (struct list *)
+    ((char *) ADDRESS (block) +
+     HEAPINFO (block).busy.info.frag.first * size);
+
+  if (HEAPINFO (block).busy.info.frag.nfree == nfrags - 1)
+    {
+      /* All the fragments of the block are free: take them off the
+	 list, and give the block back to the region.  */
+      next = prev;
+      for (j = 1; j < nfrags; ++j)
+	{
+	  next = next -> next;
+	}
+      prev -> prev -> next = next;
+      if (next != NULL)
+	{
+	  next -> prev = prev -> prev;
+	}
+      HEAPINFO (block).busy.type = 0;
+      HEAPINFO (block).busy.info.size = 1;
+
+      a -> stats.chunks_used++;
+      a -> stats.bytes_used += nfrags * size;
+      a -> stats.chunks_free -= nfrags;
+      a -> stats.bytes_free -= nfrags * size;
+
+      return ((PTR) ADDRESS (block));
+    }
+  else if (HEAPINFO (block).busy.info.frag.nfree != 0)
+    {
+      /* Link this fragment after the first free fragment of the block. */
+      next = (struct list *) ptr;
+      next -> next = prev -> next;
+      next -> prev = prev;
+      prev -> next = next;
+      if (next -> next != NULL)
+	{
+	  next -> next -> prev = next;
+	}
+      ++HEAPINFO (block).busy.info.frag.nfree;
+    }
+  else
+    {
+      /* This is the only free fragment of the block.  */
+      prev = (struct list *) ptr;
+      HEAPINFO (block).busy.info.frag.nfree = 1;
+      HEAPINFO (block).busy.info.frag.first =
+	RESIDUAL (ptr, BLOCKSIZE) / size;
+      prev -> next = a -> fraghead[type].next;
+      prev -> prev = &a -> fraghead[type];
+      prev -> prev -> next = prev;
+      if (prev -> next != NULL)
+	{
+	  prev -> next -> prev = prev;
+	}
+    }
+  return (NULL);
+}
+
+/* Return the heapinfo entry of BLOCK, read without any lock, so that
+   it may be in a table or a node which is being moved.  */
+
+static malloc_info *
+entry_of (mdp, block)
+  struct mdesc *mdp;
+  size_t block;
+{
+  size_t l = block / MMALLOC_INFOLEAF;
+  struct info_dir *dir;
+  struct info_leaf *leaf;
+
+  if (!(mdp -> flags & MMALLOC_INFOTREE))
+    {
+      return (&__atomic_load_n (&mdp -> heapinfo, __ATOMIC_ACQUIRE)[block]);
+    }
+  dir = (struct info_dir *)
+    (mdp -> base + __atomic_load_n (&mdp -> infodirs[l / MMALLOC_INFODIR],
+				    __ATOMIC_ACQUIRE));
+  leaf = (struct info_leaf *)
+    (mdp -> base + __atomic_load_n (&dir -> leaves[l % MMALLOC_INFODIR],
+				    __ATOMIC_ACQUIRE));
+  return (&leaf -> info[block % MMALLOC_INFOLEAF]);
+}
+
+/* Lock the arena which the fragments of BLOCK belong to.  Returns the
+   arena, or -1.  */
+
+static int
+lock_block (mdp, block)
+  struct mdesc *mdp;
+  size_t block;
+{
+  int i;
+
+  /* The entry of the block can only be trusted once its arena is
+     locked, so read it again then. */
+  for (;;)
+    {
+      i = entry_of (mdp, block) -> busy.arena;
+      if (i < 0 || i >= MMALLOC_NARENAS ||
+	  lock_arena (&mdp -> arenas[i]) != 0)
+	{
+	  return (-1);
+	}
+      if (mmalloc_refresh ((PTR) mdp) == 0 &&
+	  HEAPINFO (block).busy.arena == i)
+	{
+	  return (i);
+	}
+      pthread_mutex_unlock (&mdp -> arenas[i].lock);
+    }
+}
+
+/* Throw away the cache of this thread if its region was detached.  */
+
+static void
+check_cache ()
+{
+  unsigned long n;
+
+  if (cache.mdp != NULL && (n = __mmalloc_untracked ()) != cache.untracked)
+    {
+      if (__mmalloc_serial (cache.base) == cache.serial)
+	{
+	  cache.untracked = n;
+	}
+      else
+	{
+	  memset (&cache, 0, sizeof (cache));
+	}
+    }
+}
+
+/* Give the last N fragments of size class C in the cache of this thread
+   back to their arenas.  */
+
+static void
+give_back (c, n)
+  int c;
+  int n;
+{
+  struct mdesc *mdp = cache.mdp;
+  PTR empty[CACHE_SIZE];
+  PTR ptr;
+  size_t block;
+  int nempty = 0;
+  int i = -1;
+  int k;
+
+  while (n-- > 0 && cache.count[c] > 0)
+    {
+      ptr = cache.frags[c][cache.count[c] - 1];
+      block = BLOCK (ptr);
+      if (i < 0 || HEAPINFO (block).busy.arena != i)
+	{
+	  if (i >= 0)
+	    {
+	      pthread_mutex_unlock (&mdp -> arenas[i].lock);
+	    }
+	  if ((i = lock_block (mdp, block)) < 0)
+	    {
+	      break;
+	    }
+	}
+      cache.count[c]--;
+      if ((empty[nempty] = free_fragment (mdp, i, ptr, block, c)) != NULL)
+	{
+	  nempty++;
+	}
+    }
+  if (i >= 0)
+    {
+      pthread_mutex_unlock (&mdp -> arenas[i].lock);
+    }
+  for (k = 0; k < nempty; k++)
+    {
+      mfree ((PTR) mdp, empty[k]);
+    }
+}
+
+/* Give the whole cache of this thread back, if its region is still
+   there.  */
+
+static void
+flush_cache ()
+{
+  int c;
+
+  check_cache ();
+  if (cache.mdp != NULL)
+    {
+      for (c = 1; c <= CACHE_CLASSES; c++)
+	{
+	  give_back (c, cache.count[c]);
+	}
+      cache.mdp = NULL;
+    }
+}
+
+/* Make the cache of this thread hold fragments of MDP.  Returns 0 if it
+   holds fragments of another region, which are not given back here as
+   the lock of this region may be held, or if MDP can have no cache.  */
+
+static int
+use_cache (mdp)
+  struct mdesc *mdp;
+{
+  unsigned long n, serial;
+  int c;
+
+  check_cache ();
+  if (cache.mdp == mdp)
+    {
+      return (1);
+    }
+  for (c = 1; c <= CACHE_CLASSES; c++)
+    {
+      if (cache.count[c] != 0)
+	{
+	  return (0);
+	}
+    }
+  n = __mmalloc_untracked ();
+  if ((serial = __mmalloc_serial (mdp -> base)) == 0)
+    {
+      return (0);
+    }
+  thread_id ();
+  pthread_setspecific (cache_key, &cache);
+  cache.mdp = mdp;
+  cache.base = mdp -> base;
+  cache.serial = serial;
+  cache.untracked = n;
+  return (1);
+}
+
+PTR
+__mmalloc_arena_alloc (mdp, size)
+  struct mdesc *mdp;
+  size_t size;
+{
+  PTR result;
+  int c;
+
+  if (size < sizeof (struct list))
+    {
+      size = sizeof (struct list);
+    }
+  c = class_of (size);
+
+  if (c <= CACHE_CLASSES && use_cache (mdp))
+    {
+      if (cache.count[c] == 0)
+	{
+	  cache.count[c] = take (mdp, c, cache.frags[c], CACHE_BATCH);
+	}
+      if (cache.count[c] == 0)
+	{
+	  return (NULL);
+	}
+      return (cache.frags[c][--cache.count[c]]);
+    }
+  if (take (mdp, c, &result, 1) == 0)
+    {
+      return (NULL);
+    }
+  return (result);
+}
+
+int
+__mmalloc_fragment_type (mdp, ptr)
+  struct mdesc *mdp;
+  PTR ptr;
+{
+  size_t block, heapsize, moves;
+  int type;
+
+  /* Blocks from mmemalign are looked up with the lock of the region. */
+  if (!(mdp -> flags & MMALLOC_ARENAS) ||
+      (mdp -> flags & MMALLOC_READONLY) ||
+      __atomic_load_n (&mdp -> aligned_blocks, __ATOMIC_ACQUIRE) != NULL ||
+      mmalloc_refresh ((PTR) mdp) != 0)
+    {
+      return (0);
+    }
+
+  /* The type of a fragment in use does not change, but the heapinfo
+     table, or nodes of its tree, may be moved, and the old ones reused,
+     while it is read.  They are only reused after heapsize, or
+     infomoves, is updated.  */
+  block = BLOCK (ptr);
+  do
+    {
+      heapsize = __atomic_load_n (&mdp -> heapsize, __ATOMIC_ACQUIRE);
+      moves = __atomic_load_n (&mdp -> infomoves, __ATOMIC_ACQUIRE);
+      type = block < heapsize ? entry_of (mdp, block) -> busy.type : 0;
+      __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    }
+  while (__atomic_load_n (&mdp -> heapsize, __ATOMIC_RELAXED) != heapsize ||
+	 __atomic_load_n (&mdp -> infomoves, __ATOMIC_RELAXED) != moves);
+
+  return (type > 0 && type <= MMALLOC_NCLASSES ? type : 0);
+}
+
+int
+__mmalloc_arena_free (mdp, ptr)
+  struct mdesc *mdp;
+  PTR ptr;
+{
+  PTR empty;
+  size_t block;
+  int type, i;
+
+  if (mdp -> mfree_hook != NULL ||
+      (type = __mmalloc_fragment_type (mdp, ptr)) == 0)
+    {
+      return (0);
+    }
+
+  if (type <= CACHE_CLASSES && use_cache (mdp))
+    {
+      if (cache.count[type] == CACHE_SIZE)
+	{
+	  give_back (type, CACHE_BATCH);
+	}
+      if (cache.count[type] < CACHE_SIZE)
+	{
+	  cache.frags[type][cache.count[type]++] = ptr;
+	  return (1);
+	}
+    }
+
+  block = BLOCK (ptr);
+  if ((i = lock_block (mdp, block)) < 0)
+    {
+      return (0);
+    }
+  empty = free_fragment (mdp, i, ptr, block, type);
+  pthread_mutex_unlock (&mdp -> arenas[i].lock);
+  if (empty != NULL)
+    {
+      mfree ((PTR) mdp, empty);
+    }
+  return (1);
+}
+
+void
+__mmalloc_free_fragment (mdp, ptr, block)
+  struct mdesc *mdp;
+  PTR ptr;
+  size_t block;
+{
+  int i = HEAPINFO (block).busy.arena;
+  PTR empty;
+
+  if (lock_arena (&mdp -> arenas[i]) == 0)
+    {
+      empty = free_fragment (mdp, i, ptr, block,
+			     HEAPINFO (block).busy.type);
+      pthread_mutex_unlock (&mdp -> arenas[i].lock);
+      if (empty != NULL)
+	{
+	  mfree ((PTR) mdp, empty);
+	}
+    }
+}
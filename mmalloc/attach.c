@@ -22,11 +22,14 @@ Boston, MA 02111-1307, USA.  */
 
 #include <sys/types.h>
 #include <fcntl.h> /* After sys/types.h, at least for dpx/2.  */
+#include <errno.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <stdlib.h>	/* For malloc */
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>	/* Prototypes for lseek */
 #endif
+#include <sys/mman.h>	/* For munmap and mprotect */
 #include "mmprivate.h"
 
 #ifndef SEEK_SET
@@ -38,7 +41,32 @@ Boston, MA 02111-1307, USA.  */
 
 /* Forward declarations/prototypes for local functions */
 
-static struct mdesc *reuse PARAMS ((int));
+static struct mdesc *reuse PARAMS ((int, int, PTR, PTR *));
+static void relocate PARAMS ((struct mdesc *, char *, size_t));
+static void relocate_lists PARAMS ((struct list *, int, long));
+static PTR map_moved PARAMS ((struct mdesc *, PTR, PTR *));
+
+/* The logarithm of the block size of the regions created from now on.
+   See mmalloc_set_blocksize. */
+
+static int create_blocklog = MMALLOC_BLOCKLOG;
+
+int
+mmalloc_set_blocksize (size)
+  size_t size;
+{
+  int log;
+
+  for (log = MMALLOC_BLOCKLOG; log <= MMALLOC_MAXBLOCKLOG; log++)
+    {
+      if (size == (size_t) 1 << log)
+	{
+	  create_blocklog = log;
+	  return (0);
+	}
+    }
+  return (EINVAL);
+}
 
 /* Initialize access to a mmalloc managed region.
 
@@ -75,6 +103,55 @@ PTR
 mmalloc_attach (fd, baseaddr)
   int fd;
   PTR baseaddr;
+{
+  return (mmalloc_attach_flags (fd, baseaddr, 0));
+}
+
+/* Same as mmalloc_attach, with some extra FLAGS:
+
+   MMALLOC_ATTACH_HUGEPAGES asks for the region to be grown in units of
+   huge pages, and for transparent huge pages with madvise().  For files,
+   the kernel only uses transparent huge pages on tmpfs mounted with the
+   huge= option.  Files on hugetlbfs are always mapped with huge pages,
+   with or without this flag, and BASEADDR must then be aligned to the
+   huge page size.  This flag only lasts until the region is detached.
+
+   MMALLOC_ATTACH_READONLY maps an existing file read-only, so FD may be
+   opened with O_RDONLY.  The keys can be read, but nothing can be
+   allocated or freed in the region.  If another process grows the file
+   later, mmalloc_refresh maps in the new part. */
+
+PTR
+mmalloc_attach_flags (fd, baseaddr, flags)
+  int fd;
+  PTR baseaddr;
+  int flags;
+{
+  return (mmalloc_attach_relocate (fd, baseaddr, flags, NULL));
+}
+
+/* Same as mmalloc_attach_flags, but if OLDBASEP is not NULL, an existing
+   file is mapped at the address where it was created only if nothing else
+   is mapped there.  Otherwise it is mapped at BASEADDR, or at an address
+   chosen by mmap if BASEADDR is NULL or taken too, but never overlapping
+   the old place, and the pointers in the malloc descriptor and in the
+   free lists are relocated.  The keys which
+   point into the region are relocated too, but the application must
+   relocate any other pointers that it stored in the region.
+
+   The address where the region was created is stored in *OLDBASEP, so
+   the region was moved if that is not the returned malloc descriptor.
+   The new address is written to the file, unless it is read-only.  A
+   read-only region which was moved is mapped private and writable, so
+   that the application can relocate its pointers; it should then make
+   the mapping read-only with mprotect().  See mmalloc_region. */
+
+PTR
+mmalloc_attach_relocate (fd, baseaddr, flags, oldbasep)
+  int fd;
+  PTR baseaddr;
+  int flags;
+  PTR *oldbasep;
 {
   struct mdesc mtemp;
   struct mdesc *mdp;
@@ -96,9 +173,13 @@ mmalloc_attach (fd, baseaddr)
 	}
       else if (sbuf.st_size > 0)
 	{
-	  return ((PTR) reuse (fd));
+	  return ((PTR) reuse (fd, flags, baseaddr, oldbasep));
 	}
     }
+  if (flags & MMALLOC_ATTACH_READONLY)
+    {
+      return (NULL);
+    }
 
   /* We start off with the malloc descriptor allocated on the stack, until
      we build it up enough to call _mmalloc_mmap_morecore() to allocate the
@@ -110,9 +191,14 @@ mmalloc_attach (fd, baseaddr)
   strncpy (mdp -> magic, MMALLOC_MAGIC, MMALLOC_MAGIC_SIZE);
   mdp -> headersize = sizeof (mtemp);
   mdp -> version = MMALLOC_VERSION;
+  mdp -> blocklog = create_blocklog;
   mdp -> morecore = __mmalloc_mmap_morecore;
   mdp -> fd = fd;
   mdp -> base = mdp -> breakval = mdp -> top = baseaddr;
+  if (flags & MMALLOC_ATTACH_HUGEPAGES)
+    {
+      mdp -> flags |= MMALLOC_HUGEPAGES;
+    }
 
   /* If we have not been passed a valid open file descriptor for the file
      to map to, then open /dev/zero and use that to map to. */
@@ -129,6 +215,16 @@ mmalloc_attach (fd, baseaddr)
 	}
     }
 
+  /* Reserve address space for the region to grow into, at BASEADDR, or
+     wherever mmap likes if BASEADDR is NULL.  Without a reservation, the
+     region is mapped at BASEADDR if nothing else is there, as before. */
+
+  if ((mbase = __mmalloc_reserve_core (mdp, baseaddr, baseaddr != NULL))
+      != NULL)
+    {
+      mdp -> base = mdp -> breakval = mdp -> top = mbase;
+    }
+
   /*  Now try to map in the first page, copy the malloc descriptor structure
       there, and arrange to return a pointer to this new copy.  If the mapping
       fails, then close the file descriptor if it was opened by us, and arrange
@@ -138,9 +234,27 @@ mmalloc_attach (fd, baseaddr)
     {
       memcpy (mbase, mdp, sizeof (mtemp));
       mdp = (struct mdesc *) mbase;
+      if (__mmalloc_init_lock (mdp) == 0)
+	{
+	  __mmalloc_init_arenas (mdp);
+	}
+      /* Only the fragment lists of the arenas have room for the
+	 fragments of larger blocks.  */
+      if (!(mdp -> flags & MMALLOC_ARENAS))
+	{
+	  mdp -> blocklog = MMALLOC_BLOCKLOG;
+	}
+      if (oldbasep != NULL)
+	{
+	  *oldbasep = mbase;
+	}
     }
   else
     {
+      if (mdp -> base != NULL)
+	{
+	  __mmalloc_unmap (mdp -> base, 0);
+	}
       if (mdp -> flags & MMALLOC_DEVZERO)
 	{
 	  close (mdp -> fd);
@@ -171,37 +285,227 @@ mmalloc_attach (fd, baseaddr)
    will have certainly moved if the executable has changed in any way.
    We do this by calling mmcheckf() internally.
 
+   If the region is mapped read-only, the malloc descriptor in it can't
+   be updated, so a copy of it is returned instead, allocated with malloc.
+   The keys are still read from the mapped one.
+
+   If OLDBASEP is not NULL, the region may be moved, see
+   mmalloc_attach_relocate.
+
    Returns a pointer to the malloc descriptor if successful, or NULL if
    unsuccessful for some reason. */
 
 static struct mdesc *
-reuse (fd)
+reuse (fd, flags, baseaddr, oldbasep)
   int fd;
+  int flags;
+  PTR baseaddr;
+  PTR *oldbasep;
 {
   struct mdesc mtemp;
   struct mdesc *mdp = NULL;
+  PTR base;
 
   if ((lseek (fd, 0L, SEEK_SET) == 0) &&
       (read (fd, (char *) &mtemp, sizeof (mtemp)) == sizeof (mtemp)) &&
-      (mtemp.headersize == sizeof (mtemp)) &&
+      (mtemp.headersize == sizeof (mtemp) ||
+       (mtemp.version == 1 && mtemp.headersize == MMALLOC_V1_HEADERSIZE)) &&
       (strcmp (mtemp.magic, MMALLOC_MAGIC) == 0) &&
       (mtemp.version <= MMALLOC_VERSION))
     {
+      /* Version 1 files have no lock, and are used without one. */
+      if (mtemp.version == 1)
+	{
+	  mtemp.flags &= ~MMALLOC_SHARED_LOCK;
+	  mtemp.blocklog = MMALLOC_BLOCKLOG;
+	}
+      else if (mtemp.blocklog < MMALLOC_BLOCKLOG ||
+	       mtemp.blocklog > MMALLOC_MAXBLOCKLOG)
+	{
+	  return (NULL);
+	}
       mtemp.fd = fd;
-      if (__mmalloc_remap_core (&mtemp) == mtemp.base)
+      mtemp.flags &= ~MMALLOC_HUGEPAGES;
+      if (flags & MMALLOC_ATTACH_HUGEPAGES)
+	{
+	  mtemp.flags |= MMALLOC_HUGEPAGES;
+	}
+      if (flags & MMALLOC_ATTACH_READONLY)
+	{
+	  mtemp.flags |= MMALLOC_READONLY;
+	  mtemp.flags &= ~(MMALLOC_HUGEPAGES | MMALLOC_SHARED_LOCK
+			   | MMALLOC_ARENAS);
+	}
+      if (oldbasep != NULL)
+	{
+	  base = map_moved (&mtemp, baseaddr, oldbasep);
+	}
+      else
+	{
+	  base = __mmalloc_remap_core (&mtemp);
+	}
+      if (base != mtemp.base)
+	{
+	  return (NULL);
+	}
+      if (flags & MMALLOC_ATTACH_READONLY)
+	{
+	  mtemp.mmalloc_hook = NULL;
+	  mtemp.mrealloc_hook = NULL;
+	  mtemp.mfree_hook = NULL;
+	  mtemp.morecore = __mmalloc_mmap_morecore;
+	  if ((mdp = (struct mdesc *) malloc (sizeof (mtemp))) != NULL)
+	    {
+	      *mdp = mtemp;
+	    }
+	  else
+	    {
+	      __mmalloc_unmap_core (&mtemp);
+	    }
+	}
+      else
 	{
+	  /* Other processes may be using the region already. */
 	  mdp = (struct mdesc *) mtemp.base;
+	  mmalloc_lock ((PTR) mdp);
 	  mdp -> fd = fd;
+	  mdp -> flags = mtemp.flags;
+	  mdp -> blocklog = mtemp.blocklog;
 	  mdp -> morecore = __mmalloc_mmap_morecore;
 	  if (mdp -> mfree_hook != NULL)
 	    {
 	      mmcheckf ((PTR) mdp, (void (*) PARAMS ((void))) NULL, 1);
 	    }
+	  mmalloc_unlock ((PTR) mdp);
 	}
     }
   return (mdp);
 }
 
+/* Map the region described by MTEMP, which was read from its file,
+   where it was before if possible, or else at BASEADDR or anywhere,
+   and relocate it.  MTEMP is updated to describe the new mapping.
+   Returns the address of the region, or NULL on failure. */
+
+static PTR
+map_moved (mtemp, baseaddr, oldbasep)
+  struct mdesc *mtemp;
+  PTR baseaddr;
+  PTR *oldbasep;
+{
+  char *oldbase = mtemp -> base;
+  size_t size = mtemp -> top - mtemp -> base;
+  struct mdesc *mdp;
+  int fd = mtemp -> fd;
+  unsigned int flags = mtemp -> flags;
+  PTR base;
+
+  base = __mmalloc_map_core (mtemp, oldbase);
+  if (base != NULL && base != oldbase)
+    {
+      __mmalloc_unmap (base, size);
+      base = __mmalloc_map_core (mtemp, baseaddr);
+    }
+  if (base != NULL && base != oldbase &&
+      (char *) base < oldbase + size && oldbase < (char *) base + size)
+    {
+      /* The application could not tell the pointers which have been
+	 relocated from those which have not. */
+      __mmalloc_unmap (base, size);
+      base = NULL;
+    }
+  if (base == NULL)
+    {
+      return (NULL);
+    }
+  *oldbasep = oldbase;
+
+  mdp = (struct mdesc *) base;
+  if (base != oldbase)
+    {
+      relocate (mdp, oldbase, size);
+    }
+  else if (flags & MMALLOC_READONLY)
+    {
+      mprotect (base, size, PROT_READ);
+    }
+  *mtemp = *mdp;
+  mtemp -> fd = fd;
+  mtemp -> flags = flags;
+  return (base);
+}
+
+#define MOVED(ptr) ((ptr) == NULL ? (ptr) : (PTR) ((char *) (ptr) + delta))
+
+/* Relocate the fragment lists headed by HEADS by DELTA bytes.  The first
+   fragment of each list points back into the descriptor. */
+
+static void
+relocate_lists (heads, n, delta)
+  struct list *heads;
+  int n;
+  long delta;
+{
+  struct list *l;
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      for (l = &heads[i]; l -> next != NULL; l = l -> next)
+	{
+	  l -> next = MOVED (l -> next);
+	  l -> next -> prev = MOVED (l -> next -> prev);
+	}
+    }
+}
+
+/* Relocate the malloc descriptor MDP of a region of SIZE bytes which was
+   at OLDBASE and is now mapped at MDP, and the free lists in the region. */
+
+static void
+relocate (mdp, oldbase, size)
+  struct mdesc *mdp;
+  char *oldbase;
+  size_t size;
+{
+  long delta = (char *) mdp - oldbase;
+  struct alignlist *a;
+  int i;
+
+  mdp -> base = (char *) mdp;
+  mdp -> breakval += delta;
+  mdp -> top += delta;
+  mdp -> heapbase = MOVED (mdp -> heapbase);
+  mdp -> heapinfo = MOVED (mdp -> heapinfo);
+
+  relocate_lists (mdp -> fraghead, MMALLOC_BLOCKLOG, delta);
+  if (mdp -> flags & MMALLOC_ARENAS)
+    {
+      for (i = 0; i < MMALLOC_NARENAS; i++)
+	{
+	  relocate_lists (mdp -> arenas[i].fraghead, MMALLOC_NCLASSES + 1,
+			  delta);
+	}
+    }
+
+  mdp -> aligned_blocks = MOVED (mdp -> aligned_blocks);
+  for (a = mdp -> aligned_blocks; a != NULL; a = a -> next)
+    {
+      a -> next = MOVED (a -> next);
+      a -> aligned = MOVED (a -> aligned);
+      a -> exact = MOVED (a -> exact);
+    }
+
+  for (i = 0; i < MMALLOC_KEYS; i++)
+    {
+      if ((char *) mdp -> keys[i] >= oldbase &&
+	  (char *) mdp -> keys[i] < oldbase + size)
+	{
+	  mdp -> keys[i] = MOVED (mdp -> keys[i]);
+	}
+    }
+}
+
 #else	/* !defined (HAVE_MMAP) */
 
 /* For systems without mmap, the library still supplies an entry point
@@ -217,5 +521,26 @@ mmalloc_attach (fd, baseaddr)
    return (NULL);
 }
 
+/* ARGSUSED */
+PTR
+mmalloc_attach_flags (fd, baseaddr, flags)
+  int fd;
+  PTR baseaddr;
+  int flags;
+{
+   return (NULL);
+}
+
+/* ARGSUSED */
+PTR
+mmalloc_attach_relocate (fd, baseaddr, flags, oldbasep)
+  int fd;
+  PTR baseaddr;
+  int flags;
+  PTR *oldbasep;
+{
+   return (NULL);
+}
+
 #endif	/* defined (HAVE_MMAP) */
 
@@ -0,0 +1,380 @@
+/* Index of the free clusters of mmalloc managed regions.
+
+This file is part of the GNU C Library.
+
+The GNU C Library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Library General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The GNU C Library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Library General Public
+License along with the GNU C Library; see the file COPYING.LIB.  If
+not, write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+Boston, MA 02111-1307, USA.  */
+
+/* The free clusters of blocks used to be kept on a single list in
+   address order, which mfree walked to find where a freed cluster goes
+   and mmalloc walked to find one large enough.  With many free clusters
+   both get slow.  In a region with MMALLOC_FREEINDEX, the free clusters
+   are instead found through:
+
+   * a bitmap with a bit set for the first block of each free cluster.
+     Each leaf of the heapinfo tree holds the bits of its blocks, and a
+     summary word with a bit set for each word of them which is not
+     zero; each directory has a bit set for each of its leaves with a
+     bit set, and a summary word of those, and the malloc descriptor the
+     same for the directories.  This finds the free cluster before a
+     block, to coalesce with, in a few steps, and grows with the tree.
+
+   * MMALLOC_NBINS lists of free clusters by size, linked through the
+     next and prev fields of their heapinfo entries, four for each power
+     of two, and a bitmap of the lists which are not empty.  Any cluster
+     on the lists after the one a size falls in is large enough for it.
+
+   Regions made before this have MMALLOC_FREEINDEX clear, and keep the
+   list in address order.  */
+
+#include "mmprivate.h"
+
+#define BITS		SIZE_T_BIT
+#define BIT(i)		((size_t) 1 << ((i) % BITS))
+
+/* How far down its own list to look for a cluster large enough for a
+   request, when there is none on the lists after it.  */
+
+#define BIN_SCAN	16
+
+/* Return the highest bit set in the non zero WORD.  */
+
+static size_t
+top_bit (word)
+  size_t word;
+{
+  return (BITS - 1 - __builtin_clzl (word));
+}
+
+/* Return the list for free clusters of SIZE blocks.  */
+
+static int
+bin_of (size)
+  size_t size;
+{
+  int k;
+
+  if (size < 8)
+    {
+      return ((int) size);
+    }
+  k = (int) top_bit (size);
+  return (4 * (k - 1) + (int) ((size >> (k - 2)) & 3));
+}
+
+/* Return the smallest size of a free cluster on list B.  */
+
+static size_t
+bin_low (b)
+  int b;
+{
+  if (b < 8)
+    {
+      return ((size_t) b);
+    }
+  return ((size_t) (4 + (b & 3)) << (b / 4 - 1));
+}
+
+/* Set bit I of the bitmap MAP with the summary word SUM.  Returns
+   whether no bit was set before.  */
+
+static int
+set_bit (map, sum, i)
+  size_t *map;
+  size_t *sum;
+  size_t i;
+{
+  int empty = *sum == 0;
+
+  map[i / BITS] |= BIT (i);
+  *sum |= BIT (i / BITS);
+  return (empty);
+}
+
+/* Clear bit I of the bitmap MAP with the summary word SUM.  Returns
+   whether no bit is set any more.  */
+
+static int
+clear_bit (map, sum, i)
+  size_t *map;
+  size_t *sum;
+  size_t i;
+{
+  map[i / BITS] &= ~BIT (i);
+  if (map[i / BITS] == 0)
+    {
+      *sum &= ~BIT (i / BITS);
+    }
+  return (*sum == 0);
+}
+
+/* Return the last bit set before bit I of the bitmap MAP with the
+   summary word SUM, or -1.  */
+
+static long
+last_bit (map, sum, i)
+  size_t *map;
+  size_t *sum;
+  size_t i;
+{
+  size_t word;
+
+  if (i == 0)
+    {
+      return (-1);
+    }
+  i--;
+  word = map[i / BITS] & (BIT (i) | (BIT (i) - 1));
+  if (word != 0)
+    {
+      return ((long) ((i / BITS) * BITS + top_bit (word)));
+    }
+  word = *sum & (BIT (i / BITS) - 1);
+  if (word == 0)
+    {
+      return (-1);
+    }
+  i = top_bit (word);
+  return ((long) (i * BITS + top_bit (map[i])));
+}
+
+/* Start an empty index.  */
+
+void
+__mmalloc_init_map (mdp)
+  struct mdesc *mdp;
+{
+  size_t i;
+
+  for (i = 0; i < MMALLOC_INFODIRS / BITS; i++)
+    {
+      mdp -> dirmap[i] = 0;
+    }
+  mdp -> dirsum = 0;
+  for (i = 0; i < MMALLOC_NBINS; i++)
+    {
+      mdp -> bins[i] = 0;
+    }
+  for (i = 0; i < MMALLOC_NBINS / BITS; i++)
+    {
+      mdp -> binmap[i] = 0;
+    }
+}
+
+/* Tell whether BLOCK starts a free cluster.  */
+
+int
+__mmalloc_is_free (mdp, block)
+  struct mdesc *mdp;
+  size_t block;
+{
+  return (block < mdp -> heapsize &&
+	  (INFO_LEAF (block / MMALLOC_INFOLEAF)
+	   -> freemap[block % MMALLOC_INFOLEAF / BITS] & BIT (block)) != 0);
+}
+
+/* Return the last free cluster before BLOCK, or 0.  */
+
+size_t
+__mmalloc_prev_free (mdp, block)
+  struct mdesc *mdp;
+  size_t block;
+{
+  struct info_leaf *leaf;
+  struct info_dir *dir;
+  size_t l, d;
+  long i;
+
+  if (block > mdp -> heapsize)
+    {
+      block = mdp -> heapsize;
+    }
+  l = block / MMALLOC_INFOLEAF;
+  d = l / MMALLOC_INFODIR;
+
+  /* Look in the leaf of the block, then in the leaves before it in its
+     directory, then in the directories before it.  The leaf or the
+     directory is not there yet if the block is the first one past
+     them.  */
+  if (block % MMALLOC_INFOLEAF != 0)
+    {
+      leaf = INFO_LEAF (l);
+      i = last_bit (leaf -> freemap, &leaf -> freesum,
+		    block % MMALLOC_INFOLEAF);
+      if (i >= 0)
+	{
+	  return (l * MMALLOC_INFOLEAF + i);
+	}
+    }
+  i = -1;
+  if (l % MMALLOC_INFODIR != 0)
+    {
+      dir = INFO_DIR (d);
+      i = last_bit (dir -> leafmap, &dir -> leafsum, l % MMALLOC_INFODIR);
+    }
+  if (i < 0)
+    {
+      i = last_bit (mdp -> dirmap, &mdp -> dirsum, d);
+      if (i < 0)
+	{
+	  return (0);
+	}
+      d = i;
+      dir = INFO_DIR (d);
+      i = last_bit (dir -> leafmap, &dir -> leafsum, MMALLOC_INFODIR);
+    }
+
+  /* Then take the last bit set in the leaf found.  */
+  l = d * MMALLOC_INFODIR + i;
+  leaf = INFO_LEAF (l);
+  i = last_bit (leaf -> freemap, &leaf -> freesum, MMALLOC_INFOLEAF);
+  return (l * MMALLOC_INFOLEAF + i);
+}
+
+/* Set the bit of BLOCK in the bitmap, and those above it.  */
+
+static void
+map_insert (mdp, block)
+  struct mdesc *mdp;
+  size_t block;
+{
+  size_t l = block / MMALLOC_INFOLEAF;
+  size_t d = l / MMALLOC_INFODIR;
+  struct info_leaf *leaf = INFO_LEAF (l);
+  struct info_dir *dir;
+
+  if (set_bit (leaf -> freemap, &leaf -> freesum, block % MMALLOC_INFOLEAF))
+    {
+      dir = INFO_DIR (d);
+      if (set_bit (dir -> leafmap, &dir -> leafsum, l % MMALLOC_INFODIR))
+	{
+	  set_bit (mdp -> dirmap, &mdp -> dirsum, d);
+	}
+    }
+}
+
+/* Clear the bit of BLOCK in the bitmap, and those above it.  */
+
+static void
+map_remove (mdp, block)
+  struct mdesc *mdp;
+  size_t block;
+{
+  size_t l = block / MMALLOC_INFOLEAF;
+  size_t d = l / MMALLOC_INFODIR;
+  struct info_leaf *leaf = INFO_LEAF (l);
+  struct info_dir *dir;
+
+  if (clear_bit (leaf -> freemap, &leaf -> freesum, block % MMALLOC_INFOLEAF))
+    {
+      dir = INFO_DIR (d);
+      if (clear_bit (dir -> leafmap, &dir -> leafsum, l % MMALLOC_INFODIR))
+	{
+	  clear_bit (mdp -> dirmap, &mdp -> dirsum, d);
+	}
+    }
+}
+
+/* Put the free cluster at BLOCK in the index.  */
+
+void
+__mmalloc_bin_insert (mdp, block)
+  struct mdesc *mdp;
+  size_t block;
+{
+  int b = bin_of (HEAPINFO (block).free.size);
+  size_t next = mdp -> bins[b];
+
+  HEAPINFO (block).free.prev = 0;
+  HEAPINFO (block).free.next = next;
+  if (next != 0)
+    {
+      HEAPINFO (next).free.prev = block;
+    }
+  mdp -> bins[b] = block;
+  mdp -> binmap[b / BITS] |= BIT (b);
+  map_insert (mdp, block);
+}
+
+/* Take the free cluster at BLOCK out of the index, before its size
+   changes or it is used.  */
+
+void
+__mmalloc_bin_remove (mdp, block)
+  struct mdesc *mdp;
+  size_t block;
+{
+  int b = bin_of (HEAPINFO (block).free.size);
+  size_t next = HEAPINFO (block).free.next;
+  size_t prev = HEAPINFO (block).free.prev;
+
+  if (prev != 0)
+    {
+      HEAPINFO (prev).free.next = next;
+    }
+  else if ((mdp -> bins[b] = next) == 0)
+    {
+      mdp -> binmap[b / BITS] &= ~BIT (b);
+    }
+  if (next != 0)
+    {
+      HEAPINFO (next).free.prev = prev;
+    }
+  map_remove (mdp, block);
+}
+
+/* Return a free cluster of at least BLOCKS blocks, or 0.  */
+
+size_t
+__mmalloc_find_free (mdp, blocks)
+  struct mdesc *mdp;
+  size_t blocks;
+{
+  size_t block, word;
+  int b, w, n;
+
+  /* Any cluster on the lists after the one of BLOCKS is large enough,
+     and so is any on its own list if BLOCKS is the smallest size it
+     holds.  */
+  b = bin_of (blocks);
+  if (bin_low (b) != blocks)
+    {
+      b++;
+    }
+  for (w = b / BITS; w < MMALLOC_NBINS / BITS; w++)
+    {
+      word = mdp -> binmap[w];
+      if (w == b / BITS)
+	{
+	  word &= ~(BIT (b) - 1);
+	}
+      if (word != 0)
+	{
+	  return (mdp -> bins[w * BITS + __builtin_ctzl (word)]);
+	}
+    }
+
+  /* Otherwise, try the first few clusters of its own list.  */
+  n = 0;
+  for (block = mdp -> bins[bin_of (blocks)]; block != 0 && n < BIN_SCAN;
+       block = HEAPINFO (block).free.next, n++)
+    {
+      if (HEAPINFO (block).free.size >= blocks)
+	{
+	  return (block);
+	}
+    }
+  return (0);
+}
@@ -21,6 +21,7 @@ not, write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
 Boston, MA 02111-1307, USA.  */
 
 #include <sys/types.h>
+#include <stdlib.h>	/* For free */
 #include "mmprivate.h"
 
 /* Terminate access to a mmalloc managed region by unmapping all memory pages
@@ -35,7 +36,8 @@ Boston, MA 02111-1307, USA.  */
 
    Note that the malloc descriptor that we are using is currently located in
    region we are about to unmap, so we first make a local copy of it on the
-   stack and use the copy. */
+   stack and use the copy.  A region mapped read-only has its malloc
+   descriptor outside the region, allocated by reuse(). */
 
 PTR
 mmalloc_detach (md)
@@ -46,12 +48,31 @@ mmalloc_detach (md)
   if (md != NULL)
     {
 
+      /* Let another thread or process have the arena of this thread. */
+      __mmalloc_release_arena ((struct mdesc *) md);
+
       mtemp = *(struct mdesc *) md;
+
+      if (mtemp.flags & MMALLOC_READONLY)
+	{
+	  if (__mmalloc_unmap_core (&mtemp) == 0)
+	    {
+	      free (md);
+	      md = NULL;
+	    }
+	  return (md);
+	}
       
-      /* Now unmap all the pages associated with this region by asking for a
-	 negative increment equal to the current size of the region. */
-      
-      if ((mtemp.morecore (&mtemp, mtemp.base - mtemp.breakval)) == NULL)
+      /* Give back the address space reserved for the region to grow. */
+
+      __mmalloc_release_core (&mtemp);
+
+      /* Now unmap all the pages associated with this region.  This used
+	 to ask morecore for a negative increment, which its size_t
+	 argument turns into a large positive one, so that the pages
+	 stayed mapped and the region could not be attached there again. */
+
+      if (__mmalloc_unmap_core (&mtemp) != 0)
 	{
 	  /* Deallocating failed.  Update the original malloc descriptor
 	     with any changes */
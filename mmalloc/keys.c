@@ -42,9 +42,12 @@ mmalloc_setkey (md, keynum, key)
   struct mdesc *mdp = (struct mdesc *) md;
   int result = 0;
 
-  if ((mdp != NULL) && (keynum >= 0) && (keynum < MMALLOC_KEYS))
+  if ((mdp != NULL) && !(mdp -> flags & MMALLOC_READONLY) &&
+      (keynum >= 0) && (keynum < MMALLOC_KEYS) &&
+      mmalloc_lock (md) == 0)
     {
       mdp -> keys [keynum] = key;
+      mmalloc_unlock (md);
       result++;
     }
   return (result);
@@ -60,6 +63,11 @@ mmalloc_getkey (md, keynum)
 
   if ((mdp != NULL) && (keynum >= 0) && (keynum < MMALLOC_KEYS))
     {
+      if (mdp -> flags & MMALLOC_READONLY)
+	{
+	  /* Read the keys as they are now in the region. */
+	  mdp = (struct mdesc *) mdp -> base;
+	}
       keyval = mdp -> keys [keynum];
     }
   return (keyval);
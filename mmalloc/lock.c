@@ -0,0 +1,104 @@
+/* Locking of mmap'd malloc managed regions shared between processes.
+
+This file is part of the GNU C Library.
+
+The GNU C Library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Library General Public License as
+published by the Free Software Foundation; either version 2 of the
+License, or (at your option) any later version.
+
+The GNU C Library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Library General Public
+License along with the GNU C Library; see the file COPYING.LIB.  If
+not, write to the Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+Boston, MA 02111-1307, USA.  */
+
+/* Several processes may attach the same file read-write and allocate
+   from it at the same time.  They take turns with a mutex kept in the
+   malloc descriptor, so it lives in the file itself.  The mutex is
+   process-shared, recursive so that mrealloc can call mmalloc and mfree,
+   and robust so that a process dying while it holds the lock does not
+   block the others forever.
+
+   The parts of the malloc descriptor which are specific to a process,
+   such as the file descriptor, are set again each time the lock is
+   taken, and the memory another process added to the region is mapped
+   in, see __mmalloc_sync_core. */
+
+#include <errno.h>
+#include "mmprivate.h"
+
+/* Initialize the lock of the new region MDP.  If this fails, the region
+   is used without locking.  Returns 0, or an error number. */
+
+int
+__mmalloc_init_lock (mdp)
+  struct mdesc *mdp;
+{
+  pthread_mutexattr_t attr;
+  int result;
+
+  if ((result = pthread_mutexattr_init (&attr)) != 0)
+    {
+      return (result);
+    }
+  if ((result = pthread_mutexattr_settype (&attr,
+					   PTHREAD_MUTEX_RECURSIVE)) == 0 &&
+      (result = pthread_mutexattr_setpshared (&attr,
+					      PTHREAD_PROCESS_SHARED)) == 0 &&
+      (result = pthread_mutexattr_setrobust (&attr,
+					     PTHREAD_MUTEX_ROBUST)) == 0 &&
+      (result = pthread_mutex_init (&mdp -> lock, &attr)) == 0)
+    {
+      mdp -> flags |= MMALLOC_SHARED_LOCK;
+    }
+  pthread_mutexattr_destroy (&attr);
+  return (result);
+}
+
+int
+mmalloc_lock (md)
+  PTR md;
+{
+  struct mdesc *mdp = MD_TO_MDP (md);
+  int result;
+
+  if (!(mdp -> flags & MMALLOC_SHARED_LOCK))
+    {
+      return (0);
+    }
+  result = pthread_mutex_lock (&mdp -> lock);
+  if (result == EOWNERDEAD)
+    {
+      /* The holder died.  Whatever it did to the region stays done, and
+	 each change to the region it could have been making leaves it
+	 usable, at worst with some memory lost. */
+      result = pthread_mutex_consistent (&mdp -> lock);
+    }
+  if (result == 0 && (result = __mmalloc_sync_core (mdp)) != 0)
+    {
+      pthread_mutex_unlock (&mdp -> lock);
+    }
+  if (result != 0)
+    {
+      mdp -> saved_errno = result;
+    }
+  return (result);
+}
+
+int
+mmalloc_unlock (md)
+  PTR md;
+{
+  struct mdesc *mdp = MD_TO_MDP (md);
+
+  if (!(mdp -> flags & MMALLOC_SHARED_LOCK))
+    {
+      return (0);
+    }
+  return (pthread_mutex_unlock (&mdp -> lock));
+}
@@ -24,6 +24,61 @@ Boston, MA 02111-1307, USA.
 
 #include "mmprivate.h"
 
+/* Prototypes for local functions */
+
+static void mfree_unlocked PARAMS ((PTR, PTR));
+static void free_blocks PARAMS ((struct mdesc *, size_t));
+
+/* Put the cluster at BLOCK back in a region with an index of free
+   clusters, see bins.c, combined with the free clusters around it.  */
+
+static void
+free_blocks (mdp, block)
+  struct mdesc *mdp;
+  size_t block;
+{
+  size_t blocks = HEAPINFO (block).busy.info.size;
+  size_t next, prev;
+
+  mdp -> heapstats.chunks_free++;
+
+  /* Coalesce this cluster with its successor.  */
+  next = block + blocks;
+  if (__mmalloc_is_free (mdp, next))
+    {
+      __mmalloc_bin_remove (mdp, next);
+      blocks += HEAPINFO (next).free.size;
+      mdp -> heapstats.chunks_free--;
+    }
+
+  /* And with its predecessor.  */
+  prev = __mmalloc_prev_free (mdp, block);
+  if (prev != 0 && prev + HEAPINFO (prev).free.size == block)
+    {
+      __mmalloc_bin_remove (mdp, prev);
+      blocks += HEAPINFO (prev).free.size;
+      block = prev;
+      mdp -> heapstats.chunks_free--;
+    }
+  HEAPINFO (block).free.size = blocks;
+
+  /* Now see if we can return stuff to the system.  */
+  if (blocks >= FINAL_FREE_BLOCKS && block + blocks == mdp -> heaplimit
+      && mdp -> morecore (mdp, 0) == ADDRESS (block + blocks))
+    {
+      register size_t bytes = blocks * BLOCKSIZE;
+      mdp -> heaplimit -= blocks;
+      mdp -> morecore (mdp, -bytes);
+      mdp -> heapstats.chunks_free--;
+      mdp -> heapstats.bytes_free -= bytes;
+      return;
+    }
+  __mmalloc_bin_insert (mdp, block);
+
+  /* Set the next search to begin at this block.  */
+  mdp -> heapindex = block;
+}
+
 /* Return memory to the heap.
    Like `mfree' but don't call a mfree_hook if there is one.  */
 
@@ -39,16 +94,22 @@ __mmalloc_free (mdp, ptr)
 
   block = BLOCK (ptr);
 
-  type = mdp -> heapinfo[block].busy.type;
+  type = HEAPINFO (block).busy.type;
   switch (type)
     {
     case 0:
       /* Get as many statistics as early as we can.  */
       mdp -> heapstats.chunks_used--;
       mdp -> heapstats.bytes_used -=
-	  mdp -> heapinfo[block].busy.info.size * BLOCKSIZE;
+	  HEAPINFO (block).busy.info.size * BLOCKSIZE;
       mdp -> heapstats.bytes_free +=
-	  mdp -> heapinfo[block].busy.info.size * BLOCKSIZE;
+	  HEAPINFO (block).busy.info.size * BLOCKSIZE;
+
+      if (mdp -> flags & MMALLOC_FREEINDEX)
+	{
+	  free_blocks (mdp, block);
+	  break;
+	}
 
       /* Find the free cluster previous to this one in the free list.
 	 Start searching at the last block referenced; this may benefit
@@ -58,66 +119,66 @@ __mmalloc_free (mdp, ptr)
 	{
 	  while (i > block)
 	    {
-	      i = mdp -> heapinfo[i].free.prev;
+	      i = HEAPINFO (i).free.prev;
 	    }
 	}
       else
 	{
 	  do
 	    {
-	      i = mdp -> heapinfo[i].free.next;
+	      i = HEAPINFO (i).free.next;
 	    }
 	  while ((i != 0) && (i < block));
-	  i = mdp -> heapinfo[i].free.prev;
+	  i = HEAPINFO (i).free.prev;
 	}
 
       /* Determine how to link this block into the free list.  */
-      if (block == i + mdp -> heapinfo[i].free.size)
+      if (block == i + HEAPINFO (i).free.size)
 	{
 	  /* Coalesce this block with its predecessor.  */
-	  mdp -> heapinfo[i].free.size +=
-	    mdp -> heapinfo[block].busy.info.size;
+	  HEAPINFO (i).free.size +=
+	    HEAPINFO (block).busy.info.size;
 	  block = i;
 	}
       else
 	{
 	  /* Really link this block back into the free list.  */
-	  mdp -> heapinfo[block].free.size =
-	    mdp -> heapinfo[block].busy.info.size;
-	  mdp -> heapinfo[block].free.next = mdp -> heapinfo[i].free.next;
-	  mdp -> heapinfo[block].free.prev = i;
-	  mdp -> heapinfo[i].free.next = block;
-	  mdp -> heapinfo[mdp -> heapinfo[block].free.next].free.prev = block;
+	  HEAPINFO (block).free.size =
+	    HEAPINFO (block).busy.info.size;
+	  HEAPINFO (block).free.next = HEAPINFO (i).free.next;
+	  HEAPINFO (block).free.prev = i;
+	  HEAPINFO (i).free.next = block;
+	  HEAPINFO (HEAPINFO (block).free.next).free.prev = block;
 	  mdp -> heapstats.chunks_free++;
 	}
 
       /* Now that the block is linked in, see if we can coalesce it
 	 with its successor (by deleting its successor from the list
 	 and adding in its size).  */
-      if (block + mdp -> heapinfo[block].free.size ==
-	  mdp -> heapinfo[block].free.next)
+      if (block + HEAPINFO (block).free.size ==
+	  HEAPINFO (block).free.next)
 	{
-	  mdp -> heapinfo[block].free.size
-	    += mdp -> heapinfo[mdp -> heapinfo[block].free.next].free.size;
-	  mdp -> heapinfo[block].free.next
-	    = mdp -> heapinfo[mdp -> heapinfo[block].free.next].free.next;
-	  mdp -> heapinfo[mdp -> heapinfo[block].free.next].free.prev = block;
+	  HEAPINFO (block).free.size
+	    += HEAPINFO (HEAPINFO (block).free.next).free.size;
+	  HEAPINFO (block).free.next
+	    = HEAPINFO (HEAPINFO (block).free.next).free.next;
+	  HEAPINFO (HEAPINFO (block).free.next).free.prev = block;
 	  mdp -> heapstats.chunks_free--;
 	}
 
       /* Now see if we can return stuff to the system.  */
-      blocks = mdp -> heapinfo[block].free.size;
+      blocks = HEAPINFO (block).free.size;
       if (blocks >= FINAL_FREE_BLOCKS && block + blocks == mdp -> heaplimit
 	  && mdp -> morecore (mdp, 0) == ADDRESS (block + blocks))
 	{
 	  register size_t bytes = blocks * BLOCKSIZE;
 	  mdp -> heaplimit -= blocks;
 	  mdp -> morecore (mdp, -bytes);
-	  mdp -> heapinfo[mdp -> heapinfo[block].free.prev].free.next
-	    = mdp -> heapinfo[block].free.next;
-	  mdp -> heapinfo[mdp -> heapinfo[block].free.next].free.prev
-	    = mdp -> heapinfo[block].free.prev;
-	  block = mdp -> heapinfo[block].free.prev;
+	  HEAPINFO (HEAPINFO (block).free.prev).free.next
+	    = HEAPINFO (block).free.next;
+	  HEAPINFO (HEAPINFO (block).free.next).free.prev
+	    = HEAPINFO (block).free.prev;
+	  block = HEAPINFO (block).free.prev;
 	  mdp -> heapstats.chunks_free--;
 	  mdp -> heapstats.bytes_free -= bytes;
 	}
@@ -127,6 +188,12 @@ __mmalloc_free (mdp, ptr)
       break;
 
     default:
+      if (mdp -> flags & MMALLOC_ARENAS)
+	{
+	  __mmalloc_free_fragment (mdp, ptr, block);
+	  break;
+	}
+
       /* Do some of the statistics.  */
       mdp -> heapstats.chunks_used--;
       mdp -> heapstats.bytes_used -= 1 << type;
@@ -136,9 +203,9 @@ __mmalloc_free (mdp, ptr)
       /* Get the address of the first free fragment in this block.  */
       prev = (struct list *)
 	((char *) ADDRESS(block) +
-	 (mdp -> heapinfo[block].busy.info.frag.first << type));
+	 (HEAPINFO (block).busy.info.frag.first << type));
 
-      if (mdp -> heapinfo[block].busy.info.frag.nfree ==
+      if (HEAPINFO (block).busy.info.frag.nfree ==
 	  (BLOCKSIZE >> type) - 1)
 	{
 	  /* If all fragments of this block are free, remove them
@@ -153,8 +220,8 @@ __mmalloc_free (mdp, ptr)
 	    {
 	      next -> prev = prev -> prev;
 	    }
-	  mdp -> heapinfo[block].busy.type = 0;
-	  mdp -> heapinfo[block].busy.info.size = 1;
+	  HEAPINFO (block).busy.type = 0;
+	  HEAPINFO (block).busy.info.size = 1;
 
 	  /* Keep the statistics accurate.  */
 	  mdp -> heapstats.chunks_used++;
@@ -164,7 +231,7 @@ __mmalloc_free (mdp, ptr)
 
 	  mfree ((PTR) mdp, (PTR) ADDRESS(block));
 	}
-      else if (mdp -> heapinfo[block].busy.info.frag.nfree != 0)
+      else if (HEAPINFO (block).busy.info.frag.nfree != 0)
 	{
 	  /* If some fragments of this block are free, link this
 	     fragment into the fragment list after the first free
@@ -177,7 +244,7 @@ __mmalloc_free (mdp, ptr)
 	    {
 	      next -> next -> prev = next;
 	    }
-	  ++mdp -> heapinfo[block].busy.info.frag.nfree;
+	  ++HEAPINFO (block).busy.info.frag.nfree;
 	}
       else
 	{
@@ -185,8 +252,8 @@ __mmalloc_free (mdp, ptr)
 	     fragment into the fragment list and announce that
 	     it is the first free fragment of this block. */
 	  prev = (struct list *) ptr;
-	  mdp -> heapinfo[block].busy.info.frag.nfree = 1;
-	  mdp -> heapinfo[block].busy.info.frag.first =
+	  HEAPINFO (block).busy.info.frag.nfree = 1;
+	  HEAPINFO (block).busy.info.frag.first =
 	    RESIDUAL (ptr, BLOCKSIZE) >> type;
 	  prev -> next = mdp -> fraghead[type].next;
 	  prev -> prev = &mdp -> fraghead[type];
@@ -206,6 +273,22 @@ void
 mfree (md, ptr)
   PTR md;
   PTR ptr;
+{
+  if (ptr != NULL && __mmalloc_arena_free (MD_TO_MDP (md), ptr))
+    {
+      return;
+    }
+  if (ptr != NULL && mmalloc_lock (md) == 0)
+    {
+      mfree_unlocked (md, ptr);
+      mmalloc_unlock (md);
+    }
+}
+
+static void
+mfree_unlocked (md, ptr)
+  PTR md;
+  PTR ptr;
 {
   struct mdesc *mdp;
   register struct alignlist *l;
@@ -213,6 +296,10 @@ mfree (md, ptr)
   if (ptr != NULL)
     {
       mdp = MD_TO_MDP (md);
+      if (mdp -> flags & MMALLOC_READONLY)
+	{
+	  return;
+	}
       for (l = mdp -> aligned_blocks; l != NULL; l = l -> next)
 	{
 	  if (l -> aligned == ptr)
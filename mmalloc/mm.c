@@ -37,4 +37,7 @@ Boston, MA 02111-1307, USA. */
 #include "attach.c"
 #include "detach.c"
 #include "keys.c"
+#include "lock.c"
+#include "arena.c"
+#include "bins.c"
 #include "sbrk-sup.c"
@@ -31,6 +31,13 @@ Boston, MA 02111-1307, USA.
 static int initialize PARAMS ((struct mdesc *));
 static PTR morecore PARAMS ((struct mdesc *, size_t));
 static PTR align PARAMS ((struct mdesc *, size_t));
+static PTR mmalloc_unlocked PARAMS ((PTR, size_t));
+static size_t table_size PARAMS ((size_t));
+static PTR alloc_blocks PARAMS ((struct mdesc *, size_t));
+static malloc_info *move_table PARAMS ((struct mdesc *, size_t));
+static int grow_past_table PARAMS ((struct mdesc *, size_t));
+static int grow_tree PARAMS ((struct mdesc *, size_t, char *, size_t));
+static int grow_past_nodes PARAMS ((struct mdesc *, size_t));
 
 /* Aligned allocation.  */
 
@@ -53,28 +60,196 @@ align (mdp, size)
   return (result);
 }
 
+/* Size in bytes of a heapinfo table of HEAPSIZE entries.  */
+
+static size_t
+table_size (heapsize)
+  size_t heapsize;
+{
+  return (heapsize * sizeof (malloc_info));
+}
+
 /* Set everything up and remember that we have.  */
 
 static int
 initialize (mdp)
   struct mdesc *mdp;
 {
+  char *start;
+
+  /* Version 1 files have no room for the index of free clusters, nor
+     for the directories of the heapinfo tree.  */
+  if (mdp -> headersize != MMALLOC_V1_HEADERSIZE)
+    {
+      mdp -> flags |= MMALLOC_FREEINDEX | MMALLOC_INFOTREE;
+      start = mdp -> morecore (mdp, 0);
+      mdp -> heapbase = start +
+	(BLOCKSIZE - RESIDUAL (start, BLOCKSIZE)) % BLOCKSIZE;
+      mdp -> heapsize = 0;
+      mdp -> heapinfo = NULL;
+      __mmalloc_init_map (mdp);
+      if (!grow_tree (mdp, 1, NULL, 0))
+	{
+	  return (0);
+	}
+      mdp -> heapindex = 0;
+      mdp -> flags |= MMALLOC_INITIALIZED;
+      return (1);
+    }
   mdp -> heapsize = HEAP / BLOCKSIZE;
   mdp -> heapinfo = (malloc_info *) 
-    align (mdp, mdp -> heapsize * sizeof (malloc_info));
+    align (mdp, table_size (mdp -> heapsize));
   if (mdp -> heapinfo == NULL)
     {
       return (0);
     }
   memset ((PTR)mdp -> heapinfo, 0, mdp -> heapsize * sizeof (malloc_info));
-  mdp -> heapinfo[0].free.size = 0;
-  mdp -> heapinfo[0].free.next = mdp -> heapinfo[0].free.prev = 0;
+  HEAPINFO (0).free.size = 0;
+  HEAPINFO (0).free.next = HEAPINFO (0).free.prev = 0;
   mdp -> heapindex = 0;
   mdp -> heapbase = (char *) mdp -> heapinfo;
   mdp -> flags |= MMALLOC_INITIALIZED;
   return (1);
 }
 
+/* Move the heapinfo table to the end of the heap, with room for
+   NEWSIZE entries, and mark the old one as a busy cluster in the new
+   one.  Returns the old table, or NULL.  */
+
+static malloc_info *
+move_table (mdp, newsize)
+  struct mdesc *mdp;
+  size_t newsize;
+{
+  malloc_info *newinfo, *oldinfo;
+
+  newinfo = (malloc_info *) align (mdp, table_size (newsize));
+  if (newinfo == NULL)
+    {
+      return (NULL);
+    }
+  memset ((PTR) newinfo, 0, newsize * sizeof (malloc_info));
+  /* The arenas change the table too, see arena.c.  */
+  __mmalloc_lock_arenas (mdp);
+  memcpy ((PTR) newinfo, (PTR) mdp -> heapinfo,
+	  mdp -> heapsize * sizeof (malloc_info));
+  oldinfo = mdp -> heapinfo;
+  newinfo[BLOCK (oldinfo)].busy.type = 0;
+  newinfo[BLOCK (oldinfo)].busy.info.size
+    = BLOCKIFY (table_size (mdp -> heapsize));
+  __atomic_store_n (&mdp -> heapinfo, newinfo, __ATOMIC_RELEASE);
+  __mmalloc_unlock_arenas (mdp);
+  /* Tells __mmalloc_fragment_type the old table may now be reused.  */
+  __atomic_store_n (&mdp -> heapsize, newsize, __ATOMIC_RELEASE);
+  return (oldinfo);
+}
+
+/* Make the heapinfo tree cover the blocks up to LIMIT, with the nodes
+   it needs at the end of the heap.  If BYTES is not zero, the nodes in
+   the BYTES bytes at FROM are copied before them, and the copies used
+   from then on.  The new nodes are a busy cluster of their own.  Returns
+   0 if it can't.  */
+
+static int
+grow_tree (mdp, limit, from, bytes)
+  struct mdesc *mdp;
+  size_t limit;
+  char *from;
+  size_t bytes;
+{
+  char *start, *node;
+  size_t *offset;
+  size_t leaves = mdp -> heapsize / MMALLOC_INFOLEAF;
+  size_t dirs = (leaves + MMALLOC_INFODIR - 1) / MMALLOC_INFODIR;
+  size_t newleaves, newdirs, size, l, d;
+  long delta;
+
+  if (limit <= mdp -> heapsize && bytes == 0)
+    {
+      return (1);
+    }
+
+  /* The new nodes must be covered too.  */
+  start = mdp -> morecore (mdp, 0);
+  start += (BLOCKSIZE - RESIDUAL (start, BLOCKSIZE)) % BLOCKSIZE;
+  for (;;)
+    {
+      newleaves = (limit + MMALLOC_INFOLEAF - 1) / MMALLOC_INFOLEAF;
+      if (newleaves < leaves)
+	{
+	  newleaves = leaves;
+	}
+      newdirs = (newleaves + MMALLOC_INFODIR - 1) / MMALLOC_INFODIR;
+      if (newdirs > MMALLOC_INFODIRS)
+	{
+	  return (0);
+	}
+      size = bytes + (newleaves - leaves) * sizeof (struct info_leaf) +
+	(newdirs - dirs) * sizeof (struct info_dir);
+      if (BLOCK (start) + BLOCKIFY (size) <= newleaves * MMALLOC_INFOLEAF)
+	{
+	  break;
+	}
+      limit = BLOCK (start) + BLOCKIFY (size);
+    }
+  start = align (mdp, size);
+  if (start == NULL)
+    {
+      return (0);
+    }
+  memset ((PTR) (start + bytes), 0, size - bytes);
+
+  if (bytes != 0)
+    {
+      /* The arenas use the nodes too, see arena.c.  */
+      __mmalloc_lock_arenas (mdp);
+      memcpy ((PTR) start, (PTR) from, bytes);
+      delta = start - from;
+      for (d = 0; d < dirs; d++)
+	{
+	  offset = &mdp -> infodirs[d];
+	  if ((size_t) (mdp -> base + *offset - from) < bytes)
+	    {
+	      __atomic_store_n (offset, *offset + delta, __ATOMIC_RELEASE);
+	    }
+	}
+      for (l = 0; l < leaves; l++)
+	{
+	  offset = &INFO_DIR (l / MMALLOC_INFODIR)
+	    -> leaves[l % MMALLOC_INFODIR];
+	  if ((size_t) (mdp -> base + *offset - from) < bytes)
+	    {
+	      __atomic_store_n (offset, *offset + delta, __ATOMIC_RELEASE);
+	    }
+	}
+      __mmalloc_unlock_arenas (mdp);
+      /* Tells __mmalloc_fragment_type the old nodes may now be reused.  */
+      __atomic_store_n (&mdp -> infomoves, mdp -> infomoves + 1,
+			__ATOMIC_RELEASE);
+    }
+
+  node = start + bytes;
+  for (l = leaves; l < newleaves; l++)
+    {
+      d = l / MMALLOC_INFODIR;
+      if (d == dirs)
+	{
+	  __atomic_store_n (&mdp -> infodirs[d], node - mdp -> base,
+			    __ATOMIC_RELEASE);
+	  node += sizeof (struct info_dir);
+	  dirs++;
+	}
+      __atomic_store_n (&INFO_DIR (d) -> leaves[l % MMALLOC_INFODIR],
+			node - mdp -> base, __ATOMIC_RELEASE);
+      node += sizeof (struct info_leaf);
+    }
+  HEAPINFO (BLOCK (start)).busy.type = 0;
+  HEAPINFO (BLOCK (start)).busy.info.size = BLOCKIFY (size);
+  __atomic_store_n (&mdp -> heapsize, newleaves * MMALLOC_INFOLEAF,
+		    __ATOMIC_RELEASE);
+  return (1);
+}
+
 /* Get neatly aligned memory, initializing or
    growing the heap info table as necessary. */
 
@@ -84,7 +259,7 @@ morecore (mdp, size)
   size_t size;
 {
   PTR result;
-  malloc_info *newinfo, *oldinfo;
+  malloc_info *oldinfo;
   size_t newsize;
 
   result = align (mdp, size);
@@ -94,35 +269,286 @@ morecore (mdp, size)
     }
 
   /* Check if we need to grow the info table.  */
-  if ((size_t) BLOCK ((char *) result + size) > mdp -> heapsize)
+  if (mdp -> flags & MMALLOC_INFOTREE)
+    {
+      if (!grow_tree (mdp, BLOCK ((char *) result + size), NULL, 0))
+	{
+	  mdp -> morecore (mdp, -size);
+	  return (NULL);
+	}
+    }
+  else if ((size_t) BLOCK ((char *) result + size) > mdp -> heapsize)
     {
       newsize = mdp -> heapsize;
       while ((size_t) BLOCK ((char *) result + size) > newsize)
 	{
 	  newsize *= 2;
 	}
-      newinfo = (malloc_info *) align (mdp, newsize * sizeof (malloc_info));
-      if (newinfo == NULL)
+      oldinfo = move_table (mdp, newsize);
+      if (oldinfo == NULL)
 	{
 	  mdp -> morecore (mdp, -size);
 	  return (NULL);
 	}
-      memset ((PTR) newinfo, 0, newsize * sizeof (malloc_info));
-      memcpy ((PTR) newinfo, (PTR) mdp -> heapinfo,
-	      mdp -> heapsize * sizeof (malloc_info));
-      oldinfo = mdp -> heapinfo;
-      newinfo[BLOCK (oldinfo)].busy.type = 0;
-      newinfo[BLOCK (oldinfo)].busy.info.size
-	= BLOCKIFY (mdp -> heapsize * sizeof (malloc_info));
-      mdp -> heapinfo = newinfo;
       __mmalloc_free (mdp, (PTR)oldinfo);
-      mdp -> heapsize = newsize;
     }
 
   mdp -> heaplimit = BLOCK ((char *) result + size);
   return (result);
 }
 
+/* Allocate BLOCKS blocks in a region with an index of free clusters,
+   see bins.c.  Called with the region locked.  */
+
+static PTR
+alloc_blocks (mdp, blocks)
+  struct mdesc *mdp;
+  size_t blocks;
+{
+  PTR result;
+  size_t block, lastblocks;
+
+  for (;;)
+    {
+      /* Try the cluster freed last first, so that mrealloc can grow a
+	 block into the free blocks after it.  */
+      block = mdp -> heapindex;
+      if (!__mmalloc_is_free (mdp, block) ||
+	  HEAPINFO (block).free.size < blocks)
+	{
+	  block = __mmalloc_find_free (mdp, blocks);
+	}
+      if (block != 0)
+	{
+	  break;
+	}
+
+      /* Need to get more from the system.  Check to see if the new
+	 core will be contiguous with the final free cluster; if so we
+	 don't need to get as much.  */
+      block = __mmalloc_prev_free (mdp, mdp -> heaplimit);
+      lastblocks = block != 0 ? HEAPINFO (block).free.size : 0;
+      if (block != 0 &&
+	  block + lastblocks == mdp -> heaplimit &&
+	  mdp -> morecore (mdp, 0) == ADDRESS (block + lastblocks) &&
+	  (morecore (mdp, (blocks - lastblocks) * BLOCKSIZE)) != NULL)
+	{
+	  /* The final free cluster may have been combined with a freed
+	     info table.  */
+	  block = __mmalloc_prev_free (mdp, block + lastblocks);
+	  __mmalloc_bin_remove (mdp, block);
+	  HEAPINFO (block).free.size += blocks - lastblocks;
+	  __mmalloc_bin_insert (mdp, block);
+	  mdp -> heapindex = block;
+	  mdp -> heapstats.bytes_free += (blocks - lastblocks) * BLOCKSIZE;
+	  continue;
+	}
+      result = morecore (mdp, blocks * BLOCKSIZE);
+      if (result == NULL)
+	{
+	  return (NULL);
+	}
+      block = BLOCK (result);
+      HEAPINFO (block).busy.type = 0;
+      HEAPINFO (block).busy.info.size = blocks;
+      mdp -> heapstats.chunks_used++;
+      mdp -> heapstats.bytes_used += blocks * BLOCKSIZE;
+      return (result);
+    }
+
+  /* Take what we need from the cluster, and put back what is left.  */
+  __mmalloc_bin_remove (mdp, block);
+  if (HEAPINFO (block).free.size > blocks)
+    {
+      HEAPINFO (block + blocks).free.size
+	= HEAPINFO (block).free.size - blocks;
+      __mmalloc_bin_insert (mdp, block + blocks);
+      mdp -> heapindex = block + blocks;
+    }
+  else
+    {
+      mdp -> heapstats.chunks_free--;
+    }
+
+  HEAPINFO (block).busy.type = 0;
+  HEAPINFO (block).busy.info.size = blocks;
+  mdp -> heapstats.chunks_used++;
+  mdp -> heapstats.bytes_used += blocks * BLOCKSIZE;
+  mdp -> heapstats.bytes_free -= blocks * BLOCKSIZE;
+  return (ADDRESS (block));
+}
+
+/* Make the blocks up to LIMIT part of the heap, when the heapinfo table
+   is in their way at the end of it, by moving the table after them and
+   getting more core for what it didn't cover.  Returns 0 if it can't.  */
+
+static int
+grow_past_table (mdp, limit)
+  struct mdesc *mdp;
+  size_t limit;
+{
+  size_t tend = BLOCK (mdp -> heapinfo) +
+    BLOCKIFY (table_size (mdp -> heapsize));
+  size_t newsize = mdp -> heapsize;
+
+  if (limit > tend && align (mdp, (limit - tend) * BLOCKSIZE) == NULL)
+    {
+      return (0);
+    }
+  while (newsize < limit || newsize < tend)
+    {
+      newsize *= 2;
+    }
+  if (move_table (mdp, newsize) == NULL)
+    {
+      if (limit > tend)
+	{
+	  mdp -> morecore (mdp, -((limit - tend) * BLOCKSIZE));
+	}
+      return (0);
+    }
+  if (limit < tend)
+    {
+      /* Free what is left of the old table.  */
+      mdp -> heaplimit = tend;
+      HEAPINFO (limit).busy.type = 0;
+      HEAPINFO (limit).busy.info.size = tend - limit;
+      __mmalloc_free (mdp, ADDRESS (limit));
+    }
+  else
+    {
+      mdp -> heaplimit = limit;
+    }
+  return (1);
+}
+
+/* Make the blocks up to LIMIT part of the heap, when the nodes last
+   added to the heapinfo tree are in their way at the end of it, by
+   moving them after them.  Returns 0 if it can't.  */
+
+static int
+grow_past_nodes (mdp, limit)
+  struct mdesc *mdp;
+  size_t limit;
+{
+  size_t end = mdp -> heaplimit;
+  size_t nend = end + HEAPINFO (end).busy.info.size;
+  char *from = ADDRESS (end);
+  size_t bytes = (char *) mdp -> morecore (mdp, 0) - from;
+
+  if (bytes == 0 || bytes > (nend - end) * BLOCKSIZE)
+    {
+      return (0);
+    }
+  if (limit > nend && align (mdp, (limit - nend) * BLOCKSIZE) == NULL)
+    {
+      return (0);
+    }
+  if (!grow_tree (mdp, limit, from, bytes))
+    {
+      if (limit > nend)
+	{
+	  mdp -> morecore (mdp, -((limit - nend) * BLOCKSIZE));
+	}
+      return (0);
+    }
+  if (limit < nend)
+    {
+      /* Free what is left of the old nodes.  */
+      mdp -> heaplimit = nend;
+      HEAPINFO (limit).busy.type = 0;
+      HEAPINFO (limit).busy.info.size = nend - limit;
+      __mmalloc_free (mdp, ADDRESS (limit));
+    }
+  else
+    {
+      mdp -> heaplimit = limit;
+    }
+  return (1);
+}
+
+/* Grow the cluster of busy blocks at BLOCK to BLOCKS blocks where it is,
+   into the free cluster after it if it is large enough, or with more
+   core if the cluster, or the free one after it, ends the heap.  Returns
+   0 if it can't.  Called with the region locked.  */
+
+int
+__mmalloc_grow_blocks (mdp, block, blocks)
+  struct mdesc *mdp;
+  size_t block;
+  size_t blocks;
+{
+  size_t next = block + HEAPINFO (block).busy.info.size;
+  size_t more = blocks - HEAPINFO (block).busy.info.size;
+  size_t nfree = 0;
+  size_t end;
+  int isfree;
+
+  /* Regions without the index can't tell a free cluster from a busy
+     one, and only grow at the end of the heap.  */
+  isfree = ((mdp -> flags & MMALLOC_FREEINDEX) &&
+	    __mmalloc_is_free (mdp, next));
+  if (isfree)
+    {
+      nfree = HEAPINFO (next).free.size;
+    }
+  if (nfree < more)
+    {
+      /* The heapinfo table, or the nodes last added to its tree, are
+	 usually right after the end of the heap, as they grow along with
+	 it.  */
+      end = next + nfree;
+      if (end != mdp -> heaplimit)
+	{
+	  return (0);
+	}
+      if (mdp -> morecore (mdp, 0) == ADDRESS (end))
+	{
+	  if (morecore (mdp, (more - nfree) * BLOCKSIZE) == NULL)
+	    {
+	      return (0);
+	    }
+	}
+      else if (mdp -> flags & MMALLOC_INFOTREE)
+	{
+	  if (!grow_past_nodes (mdp, next + more))
+	    {
+	      return (0);
+	    }
+	}
+      else if ((PTR) mdp -> heapinfo != ADDRESS (end) ||
+	       mdp -> morecore (mdp, 0) !=
+	       (char *) mdp -> heapinfo + table_size (mdp -> heapsize) ||
+	       !grow_past_table (mdp, next + more))
+	{
+	  return (0);
+	}
+      mdp -> heapstats.bytes_free += (more - nfree) * BLOCKSIZE;
+      nfree = more;
+    }
+
+  /* Take what we need from the free cluster, and put back what is
+     left.  The new core, if any, was in no cluster.  */
+  if (isfree)
+    {
+      __mmalloc_bin_remove (mdp, next);
+      if (nfree > more)
+	{
+	  HEAPINFO (next + more).free.size = nfree - more;
+	  __mmalloc_bin_insert (mdp, next + more);
+	  mdp -> heapindex = next + more;
+	}
+      else
+	{
+	  mdp -> heapstats.chunks_free--;
+	}
+    }
+  HEAPINFO (block).busy.info.size = blocks;
+  mdp -> heapstats.bytes_used += more * BLOCKSIZE;
+  mdp -> heapstats.bytes_free -= more * BLOCKSIZE;
+  return (1);
+}
+
 /* Allocate memory from the heap.  */
 
 PTR
@@ -132,6 +558,40 @@ mmalloc (md, size)
 {
   struct mdesc *mdp;
   PTR result;
+
+  if (size == 0)
+    {
+      return (NULL);
+    }
+
+  /* Fragments come from the arena of the thread, without the lock of the
+     region, once the heap is set up.  */
+  mdp = MD_TO_MDP (md);
+  if (size <= BLOCKSIZE / 2 &&
+      (mdp -> flags & MMALLOC_ARENAS) &&
+      (mdp -> flags & MMALLOC_INITIALIZED) &&
+      !(mdp -> flags & MMALLOC_READONLY) &&
+      mdp -> mmalloc_hook == NULL)
+    {
+      return (__mmalloc_arena_alloc (mdp, size));
+    }
+
+  if (mmalloc_lock (md) != 0)
+    {
+      return (NULL);
+    }
+  result = mmalloc_unlocked (md, size);
+  mmalloc_unlock (md);
+  return (result);
+}
+
+static PTR
+mmalloc_unlocked (md, size)
+  PTR md;
+  size_t size;
+{
+  struct mdesc *mdp;
+  PTR result;
   size_t block, blocks, lastblocks, start;
   register size_t i;
   struct list *next;
@@ -143,6 +603,11 @@ mmalloc (md, size)
     }
 
   mdp = MD_TO_MDP (md);
+
+  if (mdp -> flags & MMALLOC_READONLY)
+    {
+      return (NULL);
+    }
       
   if (mdp -> mmalloc_hook != NULL)
     {
@@ -163,7 +628,11 @@ mmalloc (md, size)
     }
 
   /* Determine the allocation policy based on the request size.  */
-  if (size <= BLOCKSIZE / 2)
+  if (size <= BLOCKSIZE / 2 && (mdp -> flags & MMALLOC_ARENAS))
+    {
+      return (__mmalloc_arena_alloc (mdp, size));
+    }
+  else if (size <= BLOCKSIZE / 2)
     {
       /* Small allocation to receive a fragment of a block.
 	 Determine the logarithm to base two of the fragment size. */
@@ -189,9 +658,9 @@ mmalloc (md, size)
 	      next -> next -> prev = next -> prev;
 	    }
 	  block = BLOCK (result);
-	  if (--mdp -> heapinfo[block].busy.info.frag.nfree != 0)
+	  if (--HEAPINFO (block).busy.info.frag.nfree != 0)
 	    {
-	      mdp -> heapinfo[block].busy.info.frag.first =
+	      HEAPINFO (block).busy.info.frag.first =
 		RESIDUAL (next -> next, BLOCKSIZE) >> log;
 	    }
 
@@ -226,15 +695,19 @@ mmalloc (md, size)
 
 	  /* Initialize the nfree and first counters for this block.  */
 	  block = BLOCK (result);
-	  mdp -> heapinfo[block].busy.type = log;
-	  mdp -> heapinfo[block].busy.info.frag.nfree = i - 1;
-	  mdp -> heapinfo[block].busy.info.frag.first = i - 1;
+	  HEAPINFO (block).busy.type = log;
+	  HEAPINFO (block).busy.info.frag.nfree = i - 1;
+	  HEAPINFO (block).busy.info.frag.first = i - 1;
 
 	  mdp -> heapstats.chunks_free += (BLOCKSIZE >> log) - 1;
 	  mdp -> heapstats.bytes_free += BLOCKSIZE - (1 << log);
  	  mdp -> heapstats.bytes_used -= BLOCKSIZE - (1 << log);
 	}
     }
+  else if (mdp -> flags & MMALLOC_FREEINDEX)
+    {
+      result = alloc_blocks (mdp, BLOCKIFY (size));
+    }
   else
     {
       /* Large allocation to receive one or more blocks.
@@ -243,16 +716,16 @@ mmalloc (md, size)
 	 space we will have to get more memory from the system.  */
       blocks = BLOCKIFY(size);
       start = block = MALLOC_SEARCH_START;
-      while (mdp -> heapinfo[block].free.size < blocks)
+      while (HEAPINFO (block).free.size < blocks)
 	{
-	  block = mdp -> heapinfo[block].free.next;
+	  block = HEAPINFO (block).free.next;
 	  if (block == start)
 	    {
 	      /* Need to get more from the system.  Check to see if
 		 the new core will be contiguous with the final free
 		 block; if so we don't need to get as much.  */
-	      block = mdp -> heapinfo[0].free.prev;
-	      lastblocks = mdp -> heapinfo[block].free.size;
+	      block = HEAPINFO (0).free.prev;
+	      lastblocks = HEAPINFO (block).free.size;
 	      if (mdp -> heaplimit != 0 &&
 		  block + lastblocks == mdp -> heaplimit &&
 		  mdp -> morecore (mdp, 0) == ADDRESS(block + lastblocks) &&
@@ -261,9 +734,9 @@ mmalloc (md, size)
 		  /* Which block we are extending (the `final free
 		     block' referred to above) might have changed, if
 		     it got combined with a freed info table.  */
-		  block = mdp -> heapinfo[0].free.prev;
+		  block = HEAPINFO (0).free.prev;
 
-		  mdp -> heapinfo[block].free.size += (blocks - lastblocks);
+		  HEAPINFO (block).free.size += (blocks - lastblocks);
 		  mdp -> heapstats.bytes_free +=
 		      (blocks - lastblocks) * BLOCKSIZE;
 		  continue;
@@ -274,8 +747,8 @@ mmalloc (md, size)
 		  return (NULL);
 		}
 	      block = BLOCK (result);
-	      mdp -> heapinfo[block].busy.type = 0;
-	      mdp -> heapinfo[block].busy.info.size = blocks;
+	      HEAPINFO (block).busy.type = 0;
+	      HEAPINFO (block).busy.info.size = blocks;
 	      mdp -> heapstats.chunks_used++;
 	      mdp -> heapstats.bytes_used += blocks * BLOCKSIZE;
 	      return (result);
@@ -285,33 +758,33 @@ mmalloc (md, size)
       /* At this point we have found a suitable free list entry.
 	 Figure out how to remove what we need from the list. */
       result = ADDRESS(block);
-      if (mdp -> heapinfo[block].free.size > blocks)
+      if (HEAPINFO (block).free.size > blocks)
 	{
 	  /* The block we found has a bit left over,
 	     so relink the tail end back into the free list. */
-	  mdp -> heapinfo[block + blocks].free.size
-	    = mdp -> heapinfo[block].free.size - blocks;
-	  mdp -> heapinfo[block + blocks].free.next
-	    = mdp -> heapinfo[block].free.next;
-	  mdp -> heapinfo[block + blocks].free.prev
-	    = mdp -> heapinfo[block].free.prev;
-	  mdp -> heapinfo[mdp -> heapinfo[block].free.prev].free.next
-	    = mdp -> heapinfo[mdp -> heapinfo[block].free.next].free.prev
+	  HEAPINFO (block + blocks).free.size
+	    = HEAPINFO (block).free.size - blocks;
+	  HEAPINFO (block + blocks).free.next
+	    = HEAPINFO (block).free.next;
+	  HEAPINFO (block + blocks).free.prev
+	    = HEAPINFO (block).free.prev;
+	  HEAPINFO (HEAPINFO (block).free.prev).free.next
+	    = HEAPINFO (HEAPINFO (block).free.next).free.prev
 	      = mdp -> heapindex = block + blocks;
 	}
       else
 	{
 	  /* The block exactly matches our requirements,
 	     so just remove it from the list. */
-	  mdp -> heapinfo[mdp -> heapinfo[block].free.next].free.prev
-	    = mdp -> heapinfo[block].free.prev;
-	  mdp -> heapinfo[mdp -> heapinfo[block].free.prev].free.next
-	    = mdp -> heapindex = mdp -> heapinfo[block].free.next;
+	  HEAPINFO (HEAPINFO (block).free.next).free.prev
+	    = HEAPINFO (block).free.prev;
+	  HEAPINFO (HEAPINFO (block).free.prev).free.next
+	    = mdp -> heapindex = HEAPINFO (block).free.next;
 	  mdp -> heapstats.chunks_free--;
 	}
 
-      mdp -> heapinfo[block].busy.type = 0;
-      mdp -> heapinfo[block].busy.info.size = blocks;
+      HEAPINFO (block).busy.type = 0;
+      HEAPINFO (block).busy.info.size = blocks;
       mdp -> heapstats.chunks_used++;
       mdp -> heapstats.bytes_used += blocks * BLOCKSIZE;
       mdp -> heapstats.bytes_free -= blocks * BLOCKSIZE;
@@ -47,16 +47,72 @@ extern struct mstats mmstats PARAMS ((PTR));
 
 extern PTR mmalloc_attach PARAMS ((int, PTR));
 
+/* Same as mmalloc_attach, with some of the MMALLOC_ATTACH_* FLAGS.  */
+
+extern PTR mmalloc_attach_flags PARAMS ((int, PTR, int));
+
+#define MMALLOC_ATTACH_HUGEPAGES (1 << 0)	/* Ask for huge pages.  */
+#define MMALLOC_ATTACH_READONLY (1 << 1)	/* Existing file, read-only.  */
+
+/* Same as mmalloc_attach_flags, but an existing file may be mapped
+   somewhere else than where it was created.  */
+
+extern PTR mmalloc_attach_relocate PARAMS ((int, PTR, int, PTR *));
+
 extern PTR mmalloc_detach PARAMS ((PTR));
 
 extern int mmalloc_setkey PARAMS ((PTR, int, PTR));
 
 extern PTR mmalloc_getkey PARAMS ((PTR, int));
 
+/* Return the error number of the last system call made by mmalloc for
+   MD which failed, or 0 if the region was last grown successfully.  */
+
 extern int mmalloc_errno PARAMS ((PTR));
 
+/* Grow mapped regions by at least MIN bytes, or PERCENT percent of their
+   current size, whichever is more.  The default is 1 MB or 25%.  */
+
+extern void mmalloc_set_growth PARAMS ((size_t, int));
+
+/* Reserve SIZE bytes of address space for each region attached
+   read-write from now on, so that it can grow that far without meeting
+   other mappings.  The default is 256 GB on 64-bit hosts.  0 turns this
+   off.  */
+
+extern void mmalloc_set_reserve PARAMS ((size_t));
+
+/* Give the regions created from now on blocks of SIZE bytes, a power
+   of two from 4 KB, the default, to 2 MB.  Larger blocks make the
+   accounting of a heap of a few huge objects much smaller, but requests
+   for more than half a block are rounded up to whole blocks.  Regions
+   without a shared lock keep the default.  Returns 0, or EINVAL.  */
+
+extern int mmalloc_set_blocksize PARAMS ((size_t));
+
+/* Lock the region of MD against changes by other threads and processes,
+   as mmalloc, mfree and friends do while they change it.  The lock is
+   recursive, so the region may be used while it is held.  If the process
+   holding it dies, the next one to take it goes ahead with the region as
+   it was left.  Returns 0, or an error number.  */
+
+extern int mmalloc_lock PARAMS ((PTR));
+
+extern int mmalloc_unlock PARAMS ((PTR));
+
+/* Map in what other processes added to the region of MD since it was
+   attached.  This does not take the lock, and works on regions attached
+   read-only.  Returns 0, or an error number.  */
+
+extern int mmalloc_refresh PARAMS ((PTR));
+
 extern int mmtrace PARAMS ((void));
 
 extern PTR mmalloc_findbase PARAMS ((size_t));
 
+/* Return the start of the region mapped for MD, and store its size in
+   *SIZEP.  */
+
+extern PTR mmalloc_region PARAMS ((PTR, size_t *));
+
 #endif  /* MMALLOC_H */
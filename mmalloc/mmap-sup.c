@@ -28,6 +28,11 @@ Boston, MA 02111-1307, USA.  */
 #include <stdio.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <errno.h>
+#include <stdlib.h>	/* For malloc */
+#ifdef __linux__
+#include <sys/vfs.h>	/* For fstatfs */
+#endif
 
 #ifndef SEEK_SET
 #define SEEK_SET 0
@@ -49,6 +54,354 @@ extern int getpagesize PARAMS ((void));
 				    ~(pagesize - 1))
 
 
+#define ALIGN_UP(addr, size) (caddr_t) (((long)(addr) + (size) - 1) & \
+				       ~((size) - 1))
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/* Older kernels ignore MAP_FIXED_NOREPLACE and take the address as a
+   hint, so the address we get back must be checked anyway. */
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+/* If the file mapped by MDP is on hugetlbfs, return its huge page size.
+   Otherwise return 0.  */
+
+static size_t
+hugetlbfs_pagesize (mdp)
+  struct mdesc *mdp;
+{
+#ifdef __linux__
+  struct statfs sbuf;
+
+  if (!(mdp -> flags & MMALLOC_DEVZERO) &&
+      fstatfs (mdp -> fd, &sbuf) == 0 &&
+      sbuf.f_type == HUGETLBFS_MAGIC)
+    {
+      return ((size_t) sbuf.f_bsize);
+    }
+#endif
+  return (0);
+}
+
+/* Return the unit by which the region of MDP is mapped and grown.  */
+
+static size_t
+mapping_unit (mdp)
+  struct mdesc *mdp;
+{
+  size_t unit = hugetlbfs_pagesize (mdp);
+
+  if (unit == 0)
+    {
+      unit = (mdp -> flags & MMALLOC_HUGEPAGES) ? HUGEPAGE_SIZE : pagesize;
+    }
+  return (unit);
+}
+
+/* Ask for transparent huge pages for a newly mapped range, if the user
+   wants them.  This is only a hint, so errors are ignored.  */
+
+static void
+advise_hugepages (mdp, addr, len)
+  struct mdesc *mdp;
+  caddr_t addr;
+  size_t len;
+{
+#ifdef MADV_HUGEPAGE
+  if (mdp -> flags & MMALLOC_HUGEPAGES)
+    {
+      madvise (addr, len, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+/* The region grows by at least GROWTH_MIN bytes, or GROWTH_PERCENT
+   percent of its current size, whichever is more, so that growing a
+   large region takes few system calls.  See mmalloc_set_growth. */
+
+static size_t growth_min = 1 << 20;
+static int growth_percent = 25;
+
+void
+mmalloc_set_growth (min, percent)
+  size_t min;
+  int percent;
+{
+  growth_min = min;
+  growth_percent = percent;
+}
+
+/* Extend the file of MDP to hold LEN more bytes from FOFFSET.  The
+   blocks are allocated now, so that running out of disk space is
+   reported here and not as SIGBUS when the pages are first written.
+   Returns 0, or an error number. */
+
+static int
+grow_file (mdp, foffset, len)
+  struct mdesc *mdp;
+  off_t foffset;
+  size_t len;
+{
+  if (mdp -> flags & MMALLOC_DEVZERO)
+    {
+      return (0);
+    }
+  if (hugetlbfs_pagesize (mdp) != 0)
+    {
+      /* Files on hugetlbfs can't be written to, only truncated. */
+      return (ftruncate (mdp -> fd, foffset + len) == 0 ? 0 : errno);
+    }
+  return (posix_fallocate (mdp -> fd, foffset, len));
+}
+
+/* A region mapped read-write starts at the beginning of a larger range
+   of address space reserved with PROT_NONE, and grows inside it, so that
+   it has room to grow wherever it was placed and never replaces other
+   mappings.  The reservation, how much of the region is mapped, and the
+   file descriptor only exist in the process which attached the region,
+   so they are listed here and not in the malloc descriptor. */
+
+struct mapping
+  {
+    struct mapping *next;
+    char *base;			/* Start of the region.  */
+    char *top;			/* End of the part mapped in this process.  */
+    char *end;			/* End of the reserved range, or NULL.  */
+    int fd;			/* File descriptor in this process.  */
+    unsigned long serial;	/* Tells apart attachments at BASE.  */
+  };
+
+static struct mapping *mappings;
+
+/* The last serial number given to a mapping, and how many mappings were
+   forgotten, so that caches of a region can tell it was detached.  */
+
+static unsigned long serials;
+static unsigned long untracked;
+
+/* Taken by the threads of this process to change what it has mapped of
+   a region.  */
+
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(MAP_ANONYMOUS) && (defined(__LP64__) || defined(_WIN64))
+static size_t reserve_size = (size_t) 256 << 30;
+#else
+static size_t reserve_size = 0;
+#endif
+
+void
+mmalloc_set_reserve (size)
+  size_t size;
+{
+  reserve_size = size;
+}
+
+/* Return the mapping of the region at BASE, or NULL if there is none. */
+
+static struct mapping *
+find_mapping (base)
+  char *base;
+{
+  struct mapping *m;
+
+  for (m = mappings; m != NULL; m = m -> next)
+    {
+      if (m -> base == base)
+	{
+	  return (m);
+	}
+    }
+  return (NULL);
+}
+
+/* Record that the region at BASE is mapped up to TOP with FD.  If
+   memory runs out, the region is simply not tracked. */
+
+static void
+track (base, top, fd)
+  char *base;
+  char *top;
+  int fd;
+{
+  struct mapping *m = find_mapping (base);
+
+  if (m == NULL)
+    {
+      if ((m = (struct mapping *) malloc (sizeof (*m))) == NULL)
+	{
+	  return;
+	}
+      m -> base = base;
+      m -> serial = __atomic_add_fetch (&serials, 1, __ATOMIC_RELAXED);
+      m -> end = NULL;
+      m -> top = top;
+      m -> next = mappings;
+      __atomic_store_n (&mappings, m, __ATOMIC_RELEASE);
+    }
+  __atomic_store_n (&m -> top, top, __ATOMIC_RELEASE);
+  m -> fd = fd;
+}
+
+/* Return the serial number of the mapping of the region at BASE, or 0
+   if it is not tracked.  */
+
+unsigned long
+__mmalloc_serial (base)
+  PTR base;
+{
+  struct mapping *m = find_mapping ((char *) base);
+
+  return (m != NULL ? m -> serial : 0);
+}
+
+/* Return how many regions were forgotten so far.  */
+
+unsigned long
+__mmalloc_untracked ()
+{
+  return (__atomic_load_n (&untracked, __ATOMIC_ACQUIRE));
+}
+
+/* Forget the region at BASE, and unmap the part of its reserved range
+   from FROM. */
+
+static void
+untrack (base, from)
+  char *base;
+  char *from;
+{
+  struct mapping **mp;
+  struct mapping *m;
+
+  for (mp = &mappings; (m = *mp) != NULL; mp = &m -> next)
+    {
+      if (m -> base == base)
+	{
+	  if (m -> end != NULL && from < m -> end)
+	    {
+	      munmap (from, m -> end - from);
+	    }
+	  *mp = m -> next;
+	  free (m);
+	  __atomic_add_fetch (&untracked, 1, __ATOMIC_RELEASE);
+	  return;
+	}
+    }
+}
+
+/* Give back the part of the reserved range of M which is not mapped,
+   so that the region can grow past the range. */
+
+static void
+drop_reservation (m)
+  struct mapping *m;
+{
+  if (m -> top < m -> end)
+    {
+      munmap (m -> top, m -> end - m -> top);
+    }
+  m -> end = NULL;
+}
+
+/* Reserve a range of address space for the region of MDP, as large as
+   set by mmalloc_set_reserve or as the region if that is larger.  If
+   FIXED, the range must start at ADDR and must not replace anything;
+   otherwise ADDR is only a hint, and may be NULL.  The region is then
+   mapped at the start of the range with MAP_FIXED.  Returns the start,
+   or NULL if nothing was reserved. */
+
+PTR
+__mmalloc_reserve_core (mdp, addr, fixed)
+  struct mdesc *mdp;
+  PTR addr;
+  int fixed;
+{
+#ifdef MAP_ANONYMOUS
+  size_t unit;
+  size_t size;
+  size_t extra;
+  caddr_t base;
+  caddr_t aligned;
+  struct mapping *m;
+
+  if (pagesize == 0)
+    {
+      pagesize = getpagesize ();
+    }
+  if (reserve_size == 0)
+    {
+      return (NULL);
+    }
+  unit = mapping_unit (mdp);
+  size = reserve_size;
+  if (size < (size_t) (mdp -> top - mdp -> base))
+    {
+      size = mdp -> top - mdp -> base;
+    }
+  size = (size_t) ALIGN_UP (size, unit);
+
+  /* Reserve one more unit than needed, so that a range placed by the
+     kernel can be aligned to the mapping unit. */
+  extra = (fixed || unit == pagesize) ? 0 : unit;
+  base = mmap (addr, size + extra, PROT_NONE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+	       | (fixed ? MAP_FIXED_NOREPLACE : 0), -1, 0);
+  if (base == (caddr_t) -1)
+    {
+      return (NULL);
+    }
+  if (fixed && base != addr)
+    {
+      munmap (base, size);
+      return (NULL);
+    }
+  if (extra != 0)
+    {
+      aligned = ALIGN_UP (base, unit);
+      if (aligned != base)
+	{
+	  munmap (base, aligned - base);
+	  munmap (aligned + size, base + extra - aligned);
+	}
+      else
+	{
+	  munmap (base + size, extra);
+	}
+      base = aligned;
+    }
+  track (base, base, mdp -> fd);
+  if ((m = find_mapping (base)) == NULL)
+    {
+      munmap (base, size);
+      return (NULL);
+    }
+  m -> end = base + size;
+  return ((PTR) base);
+#else
+  return (NULL);
+#endif
+}
+
+/* Give back the part of the range reserved for the region of MDP which
+   the region does not use, and forget the region. */
+
+void
+__mmalloc_release_core (mdp)
+  struct mdesc *mdp;
+{
+  untrack (mdp -> base, mdp -> top);
+}
+
 /* Return MAP_PRIVATE if MDP represents /dev/zero.  Otherwise, return
    MAP_SHARED.  */
 
@@ -71,7 +424,10 @@ __mmalloc_mmap_morecore (mdp, size)
   size_t mapbytes;	/* Number of bytes to map */
   caddr_t moveto;	/* Address where we wish to move "break value" to */
   caddr_t mapto;	/* Address we actually mapped to */
-  char buf = 0;		/* Single byte to write to extend mapped file */
+  caddr_t end;		/* End of the reserved address space */
+  struct mapping *m;	/* What this process has mapped */
+  size_t growth;	/* Minimum number of bytes to map */
+  int err;
 
   if (pagesize == 0)
     {
@@ -112,12 +468,41 @@ __mmalloc_mmap_morecore (mdp, size)
 	     the request.  This means we also have to grow the mapped-to
 	     file by an appropriate amount, since mmap cannot be used
 	     to extend a file. */
-	  moveto = PAGE_ALIGN (mdp -> breakval + size);
+	  growth = (mdp -> top - mdp -> base) / 100 * growth_percent;
+	  if (growth < growth_min)
+	    {
+	      growth = growth_min;
+	    }
+	  moveto = mdp -> breakval + size;
+	  if (moveto < mdp -> top + growth)
+	    {
+	      moveto = mdp -> top + growth;
+	    }
+	  moveto = ALIGN_UP (moveto, mapping_unit (mdp));
+	  m = find_mapping (mdp -> base);
+	  end = m != NULL ? m -> end : NULL;
+	  if (end != NULL && moveto > end)
+	    {
+	      if (mdp -> breakval + size <= end)
+		{
+		  moveto = end;
+		}
+	      else
+		{
+		  /* Go on past the reserved range if nothing is there. */
+		  drop_reservation (m);
+		  end = NULL;
+		}
+	    }
 	  mapbytes = moveto - mdp -> top;
 	  foffset = mdp -> top - mdp -> base;
-	  /* FIXME:  Test results of lseek() and write() */
-	  lseek (mdp -> fd, foffset + mapbytes - 1, SEEK_SET);
-	  write (mdp -> fd, &buf, 1);
+	  mdp -> saved_errno = 0;
+	  if ((err = grow_file (mdp, foffset, mapbytes)) != 0)
+	    {
+	      mdp -> saved_errno = err;
+	      return (NULL);
+	    }
+	  pthread_mutex_lock (&mappings_lock);
 	  if (mdp -> base == 0)
 	    {
 	      /* Let mmap pick the map start address */
@@ -125,24 +510,45 @@ __mmalloc_mmap_morecore (mdp, size)
 			    MAP_PRIVATE_OR_SHARED (mdp), mdp -> fd, foffset);
 	      if (mapto != (caddr_t) -1)
 		{
+		  advise_hugepages (mdp, mapto, mapbytes);
 		  mdp -> base = mdp -> breakval = mapto;
 		  mdp -> top = mdp -> base + mapbytes;
+		  track (mdp -> base, mdp -> top, mdp -> fd);
 		  result = (PTR) mdp -> breakval;
 		  mdp -> breakval += size;
 		}
+	      else
+		{
+		  mdp -> saved_errno = errno;
+		}
 	    }
 	  else
 	    {
+	      /* Only replace our own reservation, never other mappings
+		 placed after the region. */
 	      mapto = mmap (mdp -> top, mapbytes, PROT_READ | PROT_WRITE,
-			    MAP_PRIVATE_OR_SHARED (mdp) | MAP_FIXED, mdp -> fd,
-			    foffset);
+			    MAP_PRIVATE_OR_SHARED (mdp)
+			    | (end != NULL ? MAP_FIXED : MAP_FIXED_NOREPLACE),
+			    mdp -> fd, foffset);
 	      if (mapto == mdp -> top)
 		{
+		  advise_hugepages (mdp, mapto, mapbytes);
 		  mdp -> top = moveto;
+		  track (mdp -> base, mdp -> top, mdp -> fd);
 		  result = (PTR) mdp -> breakval;
 		  mdp -> breakval += size;
 		}
+	      else
+		{
+		  if (mapto != (caddr_t) -1)
+		    {
+		      munmap (mapto, mapbytes);
+		      errno = EEXIST;
+		    }
+		  mdp -> saved_errno = errno;
+		}
 	    }
+	  pthread_mutex_unlock (&mappings_lock);
 	}
       else
 	{
@@ -153,6 +559,91 @@ __mmalloc_mmap_morecore (mdp, size)
   return (result);
 }
 
+/* Map in the part of the region of MD which other processes added since
+   this process last mapped it.  This only reads the malloc descriptor in
+   the region, so it may be called without the lock, and works for
+   regions attached read-only too.  Returns 0, or an error number. */
+
+int
+mmalloc_refresh (md)
+  PTR md;
+{
+  struct mdesc *mdp = (struct mdesc *) md;
+  struct mapping *m = find_mapping (mdp -> base);
+  char *top;
+  size_t mapbytes;
+  caddr_t mapto;
+  int result = 0;
+
+  if (m == NULL)
+    {
+      return (0);
+    }
+  /* A region attached read-only has a copy of the malloc descriptor,
+     so read the one in the region. */
+  top = __atomic_load_n (&((struct mdesc *) mdp -> base) -> top,
+			 __ATOMIC_ACQUIRE);
+  if (top <= __atomic_load_n (&m -> top, __ATOMIC_ACQUIRE))
+    {
+      return (0);
+    }
+  pthread_mutex_lock (&mappings_lock);
+  if (top > m -> top)
+    {
+      if (m -> end != NULL && top > m -> end)
+	{
+	  drop_reservation (m);
+	}
+      mapbytes = top - m -> top;
+      mapto = mmap (m -> top, mapbytes,
+		    (mdp -> flags & MMALLOC_READONLY) ? PROT_READ
+		    : PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE_OR_SHARED (mdp)
+		    | (m -> end != NULL ? MAP_FIXED : MAP_FIXED_NOREPLACE),
+		    m -> fd, m -> top - mdp -> base);
+      if (mapto == m -> top)
+	{
+	  advise_hugepages (mdp, mapto, mapbytes);
+	  __atomic_store_n (&m -> top, top, __ATOMIC_RELEASE);
+	  if (mdp -> flags & MMALLOC_READONLY)
+	    {
+	      mdp -> top = top;
+	    }
+	}
+      else
+	{
+	  if (mapto != (caddr_t) -1)
+	    {
+	      munmap (mapto, mapbytes);
+	      errno = EEXIST;
+	    }
+	  result = errno;
+	}
+    }
+  pthread_mutex_unlock (&mappings_lock);
+  return (result);
+}
+
+/* Bring the mapping of the region of MDP in this process up to date,
+   after another process sharing the region grew it, and use this
+   process's file descriptor.  Called with the region locked.  Returns
+   0, or an error number. */
+
+int
+__mmalloc_sync_core (mdp)
+  struct mdesc *mdp;
+{
+  struct mapping *m = find_mapping (mdp -> base);
+
+  if (m == NULL)
+    {
+      return (0);
+    }
+  mdp -> fd = m -> fd;
+  mdp -> morecore = __mmalloc_mmap_morecore;
+  return (mmalloc_refresh ((PTR) mdp));
+}
+
 PTR
 __mmalloc_remap_core (mdp)
   struct mdesc *mdp;
@@ -161,12 +652,92 @@ __mmalloc_remap_core (mdp)
 
   /* FIXME:  Quick hack, needs error checking and other attention. */
 
+  /* Keep room to grow, unless something is already mapped there.  A
+     region attached read-only grows when other processes add to it,
+     see mmalloc_refresh. */
+  __mmalloc_reserve_core (mdp, mdp -> base, 1);
   base = mmap (mdp -> base, mdp -> top - mdp -> base,
-	       PROT_READ | PROT_WRITE, MAP_PRIVATE_OR_SHARED (mdp) | MAP_FIXED,
+	       (mdp -> flags & MMALLOC_READONLY) ? PROT_READ
+	       : PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE_OR_SHARED (mdp) | MAP_FIXED,
 	       mdp -> fd, 0);
+  if (base == mdp -> base)
+    {
+      advise_hugepages (mdp, base, mdp -> top - mdp -> base);
+      track (mdp -> base, mdp -> top, mdp -> fd);
+    }
+  else
+    {
+      untrack (mdp -> base, mdp -> base);
+    }
   return ((PTR) base);
 }
 
+/* Map a mmalloc region that was previously mapped at any address,
+   preferably at ADDR, without replacing any existing mapping.  A
+   read-only region is mapped private and writable, so that it can be
+   relocated.  Returns the address, or NULL on failure. */
+
+PTR
+__mmalloc_map_core (mdp, addr)
+  struct mdesc *mdp;
+  PTR addr;
+{
+  caddr_t base;
+  caddr_t reserved = NULL;
+
+  if (!(mdp -> flags & MMALLOC_READONLY))
+    {
+      reserved = __mmalloc_reserve_core (mdp, addr, 0);
+    }
+  if (reserved != NULL)
+    {
+      base = mmap (reserved, mdp -> top - mdp -> base,
+		   PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE_OR_SHARED (mdp) | MAP_FIXED, mdp -> fd, 0);
+    }
+  else
+    {
+      base = mmap (addr, mdp -> top - mdp -> base, PROT_READ | PROT_WRITE,
+		   (mdp -> flags & MMALLOC_READONLY) ? MAP_PRIVATE
+		   : MAP_PRIVATE_OR_SHARED (mdp),
+		   mdp -> fd, 0);
+    }
+  if (base == (caddr_t) -1)
+    {
+      if (reserved != NULL)
+	{
+	  untrack (reserved, reserved);
+	}
+      return (NULL);
+    }
+  if (!(mdp -> flags & MMALLOC_READONLY))
+    {
+      track (base, base + (mdp -> top - mdp -> base), mdp -> fd);
+    }
+  advise_hugepages (mdp, base, mdp -> top - mdp -> base);
+  return ((PTR) base);
+}
+
+int
+__mmalloc_unmap_core (mdp)
+  struct mdesc *mdp;
+{
+  return (__mmalloc_unmap (mdp -> base, mdp -> top - mdp -> base));
+}
+
+/* Unmap SIZE bytes mapped at BASE, and the rest of the range reserved
+   there if any. */
+
+int
+__mmalloc_unmap (base, size)
+  PTR base;
+  size_t size;
+{
+  untrack ((char *) base, (char *) base + size);
+  return (size == 0 ? 0 : munmap (base, size));
+}
+
 PTR
 mmalloc_findbase (size)
   size_t size;
@@ -215,6 +786,24 @@ mmalloc_findbase (size)
   return ((PTR) base);
 }
 
+int
+mmalloc_errno (md)
+  PTR md;
+{
+  return (((struct mdesc *) md) -> saved_errno);
+}
+
+PTR
+mmalloc_region (md, sizep)
+  PTR md;
+  size_t *sizep;
+{
+  struct mdesc *mdp = (struct mdesc *) md;
+
+  *sizep = mdp -> top - mdp -> base;
+  return ((PTR) mdp -> base);
+}
+
 #else	/* defined(HAVE_MMAP) */
 /* Prevent "empty translation unit" warnings from the idiots at X3J11. */
 static char ansi_c_idiots = 69;
@@ -18,6 +18,10 @@ Boston, MA 02111-1307, USA.  */
 
 #include "mmprivate.h"
 
+/* Prototypes for local functions */
+
+static PTR mmemalign_unlocked PARAMS ((PTR, size_t, size_t));
+
 PTR
 mmemalign (md, alignment, size)
   PTR md;
@@ -25,6 +29,23 @@ mmemalign (md, alignment, size)
   size_t size;
 {
   PTR result;
+
+  if (mmalloc_lock (md) != 0)
+    {
+      return (NULL);
+    }
+  result = mmemalign_unlocked (md, alignment, size);
+  mmalloc_unlock (md);
+  return (result);
+}
+
+static PTR
+mmemalign_unlocked (md, alignment, size)
+  PTR md;
+  size_t alignment;
+  size_t size;
+{
+  PTR result;
   unsigned long int adj;
   struct alignlist *l;
   struct mdesc *mdp;
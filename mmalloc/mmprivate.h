@@ -27,6 +27,9 @@ Boston, MA 02111-1307, USA.
 #define __MMPRIVATE_H 1
 
 #include "mmalloc.h"
+#include <stddef.h>	/* For offsetof */
+#include <pthread.h>
+#include <sys/types.h>	/* For pid_t */
 
 #ifdef HAVE_LIMITS_H
 #  include <limits.h>
@@ -42,19 +45,26 @@ Boston, MA 02111-1307, USA.
 
 #define MMALLOC_MAGIC		"mmalloc"	/* Mapped file magic number */
 #define MMALLOC_MAGIC_SIZE	8		/* Size of magic number buf */
-#define MMALLOC_VERSION		1		/* Current mmalloc version */
+#define MMALLOC_VERSION		2		/* Current mmalloc version */
 #define MMALLOC_KEYS		16		/* Keys for application use */
 
 /* The allocator divides the heap into blocks of fixed size; large
    requests receive one or more whole blocks, and small requests
    receive a fragment of a block.  Fragment sizes are powers of two,
    and all fragments of a block are the same size.  When all the
-   fragments in a block have been freed, the block itself is freed.  */
+   fragments in a block have been freed, the block itself is freed.
+
+   The size of the blocks of a region is chosen when it is created, see
+   mmalloc_set_blocksize, between MMALLOC_BLOCKLOG, the default, and
+   MMALLOC_MAXBLOCKLOG.  */
 
 #define INT_BIT		(CHAR_BIT * sizeof(int))
-#define BLOCKLOG	(INT_BIT > 16 ? 12 : 9)
+#define SIZE_T_BIT	(CHAR_BIT * sizeof (size_t))
+#define MMALLOC_BLOCKLOG	(INT_BIT > 16 ? 12 : 9)
+#define MMALLOC_MAXBLOCKLOG	21
+#define BLOCKLOG	(mdp -> blocklog)
 #define BLOCKSIZE	((size_t) 1L << BLOCKLOG)
-#define BLOCKIFY(SIZE)	(((SIZE) + BLOCKSIZE - 1) / BLOCKSIZE)
+#define BLOCKIFY(SIZE)	(((SIZE) + BLOCKSIZE - 1) >> BLOCKLOG)
 
 /* The difference between two pointers is a signed int.  On machines where
    the data addresses have the high bit set, we need to ensure that the
@@ -85,7 +95,8 @@ Boston, MA 02111-1307, USA.
 
 /* Address to block number and vice versa.  */
 
-#define BLOCK(A) (((char *) (A) - mdp -> heapbase) / BLOCKSIZE + 1)
+#define BLOCK(A) \
+  (((size_t) ((char *) (A) - mdp -> heapbase) >> BLOCKLOG) + 1)
 
 #define ADDRESS(B) ((PTR) (((B) - 1) * BLOCKSIZE + mdp -> heapbase))
 
@@ -97,8 +108,12 @@ typedef union
     struct
       {
 	/* Zero for a large block, or positive giving the
-	   logarithm to the base two of the fragment size.  */
+	   logarithm to the base two of the fragment size, or
+	   in a region with MMALLOC_ARENAS its size class.  */
 	int type;
+	/* For a fragmented block of a region with MMALLOC_ARENAS,
+	   the arena whose fragment lists hold its free fragments.  */
+	int arena;
 	union
 	  {
 	    struct
@@ -120,6 +135,35 @@ typedef union
       } free;
   } malloc_info;
 
+/* In a region with MMALLOC_INFOTREE, the heapinfo table is not one
+   array, which would have to be copied to a larger one as the heap
+   grows, but a tree of nodes in the heap: MMALLOC_INFODIRS directories
+   in the malloc descriptor, each of MMALLOC_INFODIR leaves, each of
+   MMALLOC_INFOLEAF entries.  Growing the heap only adds leaves, and
+   directories when they are full, and nodes only move when mrealloc grows
+   a cluster into the space they are in at the end of the heap.  Nodes are
+   found by their offset from the base of the region, so that they need no
+   relocation; 0 is no node.  Each node also holds its part of the bitmap
+   of free clusters, see bins.c.  */
+
+#define MMALLOC_INFOLEAF	(SIZE_T_BIT * SIZE_T_BIT)
+#define MMALLOC_INFODIR		(SIZE_T_BIT * SIZE_T_BIT)
+#define MMALLOC_INFODIRS	256
+
+struct info_leaf
+  {
+    malloc_info info[MMALLOC_INFOLEAF];
+    size_t freemap[MMALLOC_INFOLEAF / SIZE_T_BIT];
+    size_t freesum;
+  };
+
+struct info_dir
+  {
+    size_t leaves[MMALLOC_INFODIR];
+    size_t leafmap[MMALLOC_INFODIR / SIZE_T_BIT];
+    size_t leafsum;
+  };
+
 /* List of blocks allocated with `mmemalign' (or `mvalloc').  */
 
 struct alignlist
@@ -152,6 +196,35 @@ struct mstats
     size_t bytes_free;		/* Byte total of chunks in the free list. */
   };
 
+/* A sub-arena of a region shared by several writers, see arena.c.  */
+
+#define MMALLOC_NARENAS		16
+
+/* Number of size classes of the fragments of the arenas, for the blocks
+   of the region, and for the largest blocks.  */
+
+#define MMALLOC_NCLASSES	(4 * (BLOCKLOG - 6))
+#define MMALLOC_MAXCLASSES	(4 * (MMALLOC_MAXBLOCKLOG - 6))
+
+struct arena
+  {
+    /* Lock taken to use the fragment lists of this arena.  */
+    pthread_mutex_t lock;
+
+    /* Thread which claimed the arena, or 0.  */
+    pid_t owner;
+
+    /* Free lists for each size class, from 1.  */
+    struct list fraghead[MMALLOC_MAXCLASSES + 1];
+
+    /* Changes made to the statistics of the region by this arena.  */
+    struct mstats stats;
+  };
+
+/* Number of lists of free clusters, by size, see bins.c.  */
+
+#define MMALLOC_NBINS		256
+
 /* Internal structure that defines the format of the malloc-descriptor.
    This gets written to the base address of the region that mmalloc is
    managing, and thus also becomes the file header for the mapped file,
@@ -172,6 +245,11 @@ struct mdesc
 
   unsigned char version;
 
+  /* The logarithm of the size of the blocks.  Version 1 files have
+     it 0, for MMALLOC_BLOCKLOG, until they are attached.  */
+
+  unsigned char blocklog;
+
   /* Some flag bits to keep track of various internal things. */
 
   unsigned int flags;
@@ -223,7 +301,8 @@ struct mdesc
 
   PTR (*mrealloc_hook) PARAMS ((PTR, PTR, size_t));
 
-  /* Number of info entries.  */
+  /* Number of info entries, a multiple of MMALLOC_INFOLEAF in a region
+     with MMALLOC_INFOTREE.  */
 
   size_t heapsize;
 
@@ -242,7 +321,8 @@ struct mdesc
 
   /* Block information table.
      Allocated with malign/__mmalloc_free (not mmalloc/mfree).  */
-  /* Table indexed by block number giving per-block information.  */
+  /* Table indexed by block number giving per-block information, in a
+     region without MMALLOC_INFOTREE.  */
 
   malloc_info *heapinfo;
 
@@ -251,9 +331,10 @@ struct mdesc
   struct mstats heapstats;
 
   /* Free list headers for each fragment size.  */
-  /* Free lists for each fragment size.  */
+  /* Free lists for each fragment size, in regions without arenas,
+     which always have blocks of the default size.  */
 
-  struct list fraghead[BLOCKLOG];
+  struct list fraghead[MMALLOC_BLOCKLOG];
 
   /* List of blocks allocated by memalign.  */
 
@@ -287,13 +368,68 @@ struct mdesc
 
   PTR keys[MMALLOC_KEYS];
 
+  /* Lock taken by every process which changes the region, see lock.c.
+     Version 1 files end before it, and have MMALLOC_SHARED_LOCK clear,
+     so it must not be touched for them. */
+
+  pthread_mutex_t lock;
+
+  /* Sub-arenas for writers to allocate fragments from, if
+     MMALLOC_ARENAS is set, see arena.c. */
+
+  struct arena arenas[MMALLOC_NARENAS];
+
+  /* The directories of the heapinfo tree, if MMALLOC_INFOTREE is set,
+     which ones have free clusters, see bins.c, and how many times nodes
+     of the tree were moved. */
+
+  size_t infodirs[MMALLOC_INFODIRS];
+  size_t dirmap[MMALLOC_INFODIRS / SIZE_T_BIT];
+  size_t dirsum;
+  size_t infomoves;
+
+  /* Index of the free clusters, if MMALLOC_FREEINDEX is set, see
+     bins.c: which lists are not empty, and the first cluster of each
+     list. */
+
+  size_t binmap[MMALLOC_NBINS / (CHAR_BIT * sizeof (size_t))];
+  size_t bins[MMALLOC_NBINS];
+
 };
 
+/* Size of the malloc descriptor in files made by version 1.  */
+
+#define MMALLOC_V1_HEADERSIZE	offsetof (struct mdesc, lock)
+
 /* Bits to look at in the malloc descriptor flags word */
 
 #define MMALLOC_DEVZERO		(1 << 0)	/* Have mapped to /dev/zero */
 #define MMALLOC_INITIALIZED	(1 << 1)	/* Initialized mmalloc */
 #define MMALLOC_MMCHECK_USED	(1 << 2)	/* mmcheckf() called already */
+#define MMALLOC_HUGEPAGES	(1 << 3)	/* Map with huge pages */
+#define MMALLOC_READONLY	(1 << 4)	/* Mapped read-only, see reuse() */
+#define MMALLOC_SHARED_LOCK	(1 << 5)	/* The lock is initialized */
+#define MMALLOC_ARENAS		(1 << 6)	/* The arenas are initialized */
+#define MMALLOC_FREEINDEX	(1 << 7)	/* Free clusters are indexed */
+#define MMALLOC_INFOTREE	(1 << 8)	/* The heapinfo table is a tree */
+
+/* The nodes of the heapinfo tree, and the entry of block B.  */
+
+#define INFO_DIR(D) \
+  ((struct info_dir *) (mdp -> base + mdp -> infodirs[D]))
+#define INFO_LEAF(L) \
+  ((struct info_leaf *) (mdp -> base + INFO_DIR ((L) / MMALLOC_INFODIR) \
+			 -> leaves[(L) % MMALLOC_INFODIR]))
+#define HEAPINFO(B) \
+  (*((mdp -> flags & MMALLOC_INFOTREE) \
+     ? &INFO_LEAF ((B) / MMALLOC_INFOLEAF) -> info[(B) % MMALLOC_INFOLEAF] \
+     : &mdp -> heapinfo[B]))
+
+/* Size of transparent huge pages.  The region grows by multiples of this
+   when MMALLOC_HUGEPAGES is set.  Files on hugetlbfs always grow by
+   multiples of their own page size. */
+
+#define HUGEPAGE_SIZE		((size_t) 2 << 20)
 
 /* Internal version of `mfree' used in `morecore'. */
 
@@ -327,6 +463,97 @@ extern PTR __mmalloc_mmap_morecore PARAMS ((struct mdesc *, size_t));
 
 extern PTR __mmalloc_remap_core PARAMS ((struct mdesc *));
 
+/* Map a mmalloc region that was previously mapped, at any address. */
+
+extern PTR __mmalloc_map_core PARAMS ((struct mdesc *, PTR));
+
+/* Unmap a region mapped by __mmalloc_remap_core or __mmalloc_map_core. */
+
+extern int __mmalloc_unmap_core PARAMS ((struct mdesc *));
+
+/* Update the mapping of a region grown by another process. */
+
+extern int __mmalloc_sync_core PARAMS ((struct mdesc *));
+
+/* Set up the lock of a new region. */
+
+extern int __mmalloc_init_lock PARAMS ((struct mdesc *));
+
+/* Set up the arenas of a new region. */
+
+extern int __mmalloc_init_arenas PARAMS ((struct mdesc *));
+
+/* Allocate a fragment of SIZE bytes from the arena of this thread. */
+
+extern PTR __mmalloc_arena_alloc PARAMS ((struct mdesc *, size_t));
+
+/* Free the fragment PTR into the arena it belongs to, without the lock of
+   the region.  Returns 0 if PTR is not such a fragment. */
+
+extern int __mmalloc_arena_free PARAMS ((struct mdesc *, PTR));
+
+/* Return the type of the block of PTR if it is a fragment from the
+   arenas, or 0. */
+
+extern int __mmalloc_fragment_type PARAMS ((struct mdesc *, PTR));
+
+/* Return the size of the fragments of a block of type TYPE. */
+
+extern size_t __mmalloc_fragment_size PARAMS ((struct mdesc *, int));
+
+/* Same as __mmalloc_arena_free, for the fragment PTR of BLOCK, with the
+   lock of the region held. */
+
+extern void __mmalloc_free_fragment PARAMS ((struct mdesc *, PTR, size_t));
+
+/* Lock and unlock all the arenas, to move the heapinfo table or nodes
+   of its tree. */
+
+extern void __mmalloc_lock_arenas PARAMS ((struct mdesc *));
+
+extern void __mmalloc_unlock_arenas PARAMS ((struct mdesc *));
+
+/* Give back the arena claimed by this thread, and its cached
+   fragments. */
+
+extern void __mmalloc_release_arena PARAMS ((struct mdesc *));
+
+/* The index of free clusters, see bins.c. */
+
+extern void __mmalloc_init_map PARAMS ((struct mdesc *));
+
+extern int __mmalloc_is_free PARAMS ((struct mdesc *, size_t));
+
+extern size_t __mmalloc_prev_free PARAMS ((struct mdesc *, size_t));
+
+extern void __mmalloc_bin_insert PARAMS ((struct mdesc *, size_t));
+
+extern void __mmalloc_bin_remove PARAMS ((struct mdesc *, size_t));
+
+extern size_t __mmalloc_find_free PARAMS ((struct mdesc *, size_t));
+
+/* Grow a cluster of busy blocks without moving it, see mmalloc.c. */
+
+extern int __mmalloc_grow_blocks PARAMS ((struct mdesc *, size_t, size_t));
+
+/* Unmap a range of memory where a region was mapped. */
+
+extern int __mmalloc_unmap PARAMS ((PTR, size_t));
+
+/* Tell whether a region was detached since its fragments were cached. */
+
+extern unsigned long __mmalloc_serial PARAMS ((PTR));
+
+extern unsigned long __mmalloc_untracked PARAMS ((void));
+
+/* Reserve address space for a region to grow into. */
+
+extern PTR __mmalloc_reserve_core PARAMS ((struct mdesc *, PTR, int));
+
+/* Give back the reserved address space that a region does not use. */
+
+extern void __mmalloc_release_core PARAMS ((struct mdesc *));
+
 /* Macro to convert from a user supplied malloc descriptor to pointer to the
    internal malloc descriptor.  If the user supplied descriptor is NULL, then
    use the default internal version, initializing it if necessary.  Otherwise
@@ -34,6 +34,7 @@ mmstats (md)
 {
   struct mstats result;
   struct mdesc *mdp;
+  int i;
 
   mdp = MD_TO_MDP (md);
   result.bytes_total =
@@ -42,5 +43,15 @@ mmstats (md)
   result.bytes_used = mdp -> heapstats.bytes_used;
   result.chunks_free = mdp -> heapstats.chunks_free;
   result.bytes_free = mdp -> heapstats.bytes_free;
+  if (mdp -> flags & MMALLOC_ARENAS)
+    {
+      for (i = 0; i < MMALLOC_NARENAS; i++)
+	{
+	  result.chunks_used += mdp -> arenas[i].stats.chunks_used;
+	  result.bytes_used += mdp -> arenas[i].stats.bytes_used;
+	  result.chunks_free += mdp -> arenas[i].stats.chunks_free;
+	  result.bytes_free += mdp -> arenas[i].stats.bytes_free;
+	}
+    }
   return (result);
 }
@@ -24,6 +24,11 @@ Boston, MA 02111-1307, USA.
 
 #include "mmprivate.h"
 
+/* Prototypes for local functions */
+
+static PTR mrealloc_unlocked PARAMS ((PTR, PTR, size_t));
+static PTR mrealloc_fragment PARAMS ((PTR, PTR, size_t, int));
+
 /* Resize the given region to the new size, returning a pointer
    to the (possibly moved) region.  This is optimized for speed;
    some benchmarks seem to indicate that greater compactness is
@@ -40,6 +45,38 @@ mrealloc (md, ptr, size)
   struct mdesc *mdp;
   PTR result;
   int type;
+
+  /* Fragments from the arenas are resized without the lock of the
+     region, see arena.c.  */
+  if (ptr == NULL && size != 0)
+    {
+      return (mmalloc (md, size));
+    }
+  mdp = MD_TO_MDP (md);
+  if (ptr != NULL && size != 0 && mdp -> mrealloc_hook == NULL &&
+      (type = __mmalloc_fragment_type (mdp, ptr)) != 0)
+    {
+      return (mrealloc_fragment (md, ptr, size, type));
+    }
+
+  if (mmalloc_lock (md) != 0)
+    {
+      return (NULL);
+    }
+  result = mrealloc_unlocked (md, ptr, size);
+  mmalloc_unlock (md);
+  return (result);
+}
+
+static PTR
+mrealloc_unlocked (md, ptr, size)
+  PTR md;
+  PTR ptr;
+  size_t size;
+{
+  struct mdesc *mdp;
+  PTR result;
+  int type;
   size_t block, blocks, oldlimit;
 
   if (size == 0)
@@ -54,6 +91,11 @@ mrealloc (md, ptr, size)
 
   mdp = MD_TO_MDP (md);
 
+  if (mdp -> flags & MMALLOC_READONLY)
+    {
+      return (NULL);
+    }
+
   if (mdp -> mrealloc_hook != NULL)
     {
       return ((*mdp -> mrealloc_hook) (md, ptr, size));
@@ -61,7 +103,7 @@ mrealloc (md, ptr, size)
 
   block = BLOCK (ptr);
 
-  type = mdp -> heapinfo[block].busy.type;
+  type = HEAPINFO (block).busy.type;
   switch (type)
     {
     case 0:
@@ -80,27 +122,32 @@ mrealloc (md, ptr, size)
       /* The new size is a large allocation as well;
 	 see if we can hold it in place. */
       blocks = BLOCKIFY (size);
-      if (blocks < mdp -> heapinfo[block].busy.info.size)
+      if (blocks < HEAPINFO (block).busy.info.size)
 	{
 	  /* The new size is smaller; return excess memory to the free list. */
-	  mdp -> heapinfo[block + blocks].busy.type = 0;
-	  mdp -> heapinfo[block + blocks].busy.info.size
-	    = mdp -> heapinfo[block].busy.info.size - blocks;
-	  mdp -> heapinfo[block].busy.info.size = blocks;
+	  HEAPINFO (block + blocks).busy.type = 0;
+	  HEAPINFO (block + blocks).busy.info.size
+	    = HEAPINFO (block).busy.info.size - blocks;
+	  HEAPINFO (block).busy.info.size = blocks;
 	  mfree (md, ADDRESS (block + blocks));
 	  result = ptr;
 	}
-      else if (blocks == mdp -> heapinfo[block].busy.info.size)
+      else if (blocks == HEAPINFO (block).busy.info.size)
 	{
 	  /* No size change necessary.  */
 	  result = ptr;
 	}
+      else if (__mmalloc_grow_blocks (mdp, block, blocks))
+	{
+	  /* The blocks after it were free, or it ends the heap.  */
+	  result = ptr;
+	}
       else
 	{
 	  /* Won't fit, so allocate a new region that will.
 	     Free the old region first in case there is sufficient
 	     adjacent free space to grow without moving. */
-	  blocks = mdp -> heapinfo[block].busy.info.size;
+	  blocks = HEAPINFO (block).busy.info.size;
 	  /* Prevent free from actually returning memory to the system.  */
 	  oldlimit = mdp -> heaplimit;
 	  mdp -> heaplimit = 0;
@@ -120,31 +167,46 @@ mrealloc (md, ptr, size)
       break;
 
     default:
-      /* Old size is a fragment; type is logarithm
-	 to base two of the fragment size.  */
-      if (size > (size_t) (1 << (type - 1)) && size <= (size_t) (1 << type))
-	{
-	  /* The new size is the same kind of fragment.  */
-	  result = ptr;
-	}
-      else
-	{
-	  /* The new size is different; allocate a new space,
-	     and copy the lesser of the new size and the old. */
-	  result = mmalloc (md, size);
-	  if (result == NULL)
-	    {
-	      return (NULL);
-	    }
-	  memcpy (result, ptr, MIN (size, (size_t) 1 << type));
-	  mfree (md, ptr);
-	}
+      result = mrealloc_fragment (md, ptr, size, type);
       break;
     }
 
   return (result);
 }
 
+static PTR
+mrealloc_fragment (md, ptr, size, type)
+  PTR md;
+  PTR ptr;
+  size_t size;
+  int type;
+{
+  struct mdesc *mdp = MD_TO_MDP (md);
+  size_t oldsize = __mmalloc_fragment_size (mdp, type);
+  PTR result;
+
+  /* Old size is a fragment; type is logarithm to base two of the
+     fragment size, or its size class.  */
+  if (size > __mmalloc_fragment_size (mdp, type - 1) && size <= oldsize)
+    {
+      /* The new size is the same kind of fragment.  */
+      result = ptr;
+    }
+  else
+    {
+      /* The new size is different; allocate a new space,
+	 and copy the lesser of the new size and the old. */
+      result = mmalloc (md, size);
+      if (result == NULL)
+	{
+	  return (NULL);
+	}
+      memcpy (result, ptr, MIN (size, oldsize));
+      mfree (md, ptr);
+    }
+  return (result);
+}
+
 #if 0 // RWMJ
 
 /* When using this package, provide a version of malloc/realloc/free built
@@ -82,16 +82,18 @@ __mmalloc_sbrk_init ()
 {
   PTR base;
   unsigned int adj;
+  size_t blocksize = (size_t) 1 << MMALLOC_BLOCKLOG;
 
   base = sbrk (0);
-  adj = RESIDUAL (base, BLOCKSIZE);
+  adj = RESIDUAL (base, blocksize);
   if (adj != 0)
     {
-      sbrk (BLOCKSIZE - adj);
+      sbrk (blocksize - adj);
       base = sbrk (0);
     }
   __mmalloc_default_mdp = (struct mdesc *) sbrk (sizeof (struct mdesc));
   memset ((char *) __mmalloc_default_mdp, 0, sizeof (struct mdesc));
+  __mmalloc_default_mdp -> blocklog = MMALLOC_BLOCKLOG;
   __mmalloc_default_mdp -> morecore = sbrk_morecore;
   __mmalloc_default_mdp -> base = base;
   __mmalloc_default_mdp -> breakval = __mmalloc_default_mdp -> top = sbrk (0);
@@ -4,7 +4,8 @@ set -ev
 
 echo 'running tests...'
 
-ulimit -s unlimited
+./test_ancient_mark.opt
+
 wordsfile=/usr/share/dict/words
 baseaddr=0x440000000000 # System specific - see README.txt
 ./test_ancient_dict_write.opt $wordsfile dictionary.data $baseaddr
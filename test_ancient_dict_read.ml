@@ -15,8 +15,8 @@ let datafile =
 		  Sys.executable_name)
 
 let md =
-  let fd = openfile datafile [O_RDWR] 0o644 in
-  Ancient.attach fd 0n
+  let fd = openfile datafile [O_RDONLY] 0 in
+  Ancient.attach_readonly fd
 
 let arraysize = 256 (* one element for each character *)
 
@@ -0,0 +1,253 @@
+(* Mark large and cyclic structures. *)
+
+open Printf
+
+let () =
+  (* Long lists used to overflow the C stack while marking. *)
+  let n = 10_000_000 in
+  let l = List.init n (fun i -> i) in
+  let a, info = Ancient.mark_info l in
+  let l' = Ancient.follow a in
+  if List.length l' <> n then failwith "mark: wrong list length";
+  if info.Ancient.i_temp_size > info.Ancient.i_size / 100 then
+    failwith (sprintf "mark: used %d bytes of temporary memory"
+		info.Ancient.i_temp_size);
+  List.iteri (
+    fun i x ->
+      if i <> x then failwith (sprintf "mark: bad element %d" i)
+  ) l';
+  Ancient.delete a;
+
+  (* Cyclic structures must be copied with their cycles intact. *)
+  let rec c = 1 :: 2 :: c in
+  let a = Ancient.mark c in
+  let c' = Ancient.follow a in
+  (match c' with
+   | 1 :: 2 :: c'' ->
+       if c'' != c' then failwith "mark: cycle not preserved"
+   | _ -> failwith "mark: bad cyclic list");
+  Ancient.delete a;
+
+  (* Parallel marking must give the same structure, including the
+   * sharing and the cycles.
+   *)
+  let s = "shared" in
+  let t = Array.init 100_000 (fun i -> (i, s, [i; i+1], c)) in
+  List.iter (
+    fun threads ->
+      let a = Ancient.mark_parallel ~threads t in
+      let t' = Ancient.follow a in
+      if Array.length t' <> Array.length t then
+	failwith "mark_parallel: wrong array length";
+      Array.iteri (
+	fun i (j, s', l, c') ->
+	  if i <> j || s' <> s || l <> [i; i+1] then
+	    failwith (sprintf "mark_parallel: bad element %d" i);
+	  if s' != (let _, s'', _, _ = t'.(0) in s'') then
+	    failwith "mark_parallel: sharing not preserved";
+	  (match c' with
+	   | 1 :: 2 :: c'' when c'' == c' -> ()
+	   | _ -> failwith "mark_parallel: cycle not preserved")
+      ) t';
+      Ancient.delete a
+  ) [1; 2; 4; 8];
+
+  (* Incremental marking, with allocation and minor GCs between steps. *)
+  let t = Array.init 100_000 (fun i -> (i, string_of_int i, c)) in
+  let st = Ancient.mark_start t in
+  let junk = ref [] in
+  while not (Ancient.mark_step st 1000) do
+    junk := Array.make 100 0 :: !junk
+  done;
+  let a = Ancient.mark_finish st in
+  let t' = Ancient.follow a in
+  Array.iteri (
+    fun i (j, s, c') ->
+      if i <> j || s <> string_of_int i || c' != (let _, _, c = t'.(0) in c)
+      then failwith (sprintf "mark_step: bad element %d" i)
+  ) t';
+  Ancient.delete a;
+  let st = Ancient.mark_start t in
+  ignore (Ancient.mark_step_for st 0.001);
+  Ancient.mark_abort st;
+
+  (* Batches keep the sharing between their roots. *)
+  let roots = Array.init 1000 (fun i -> (i, s)) in
+  let a = Ancient.mark_many roots in
+  Array.iteri (
+    fun i p ->
+      let j, s' = Ancient.follow p in
+      if i <> j || s' <> s then failwith (sprintf "mark_many: bad root %d" i)
+  ) a;
+  if snd (Ancient.follow a.(0)) != snd (Ancient.follow a.(999)) then
+    failwith "mark_many: sharing not preserved";
+  (try Ancient.delete a.(0); failwith "mark_many: delete of a batch member"
+   with Invalid_argument _ -> ());
+  Ancient.delete_many a;
+  (try ignore (Ancient.follow a.(1)); failwith "mark_many: not deleted"
+   with Invalid_argument _ -> ());
+  let a = Ancient.mark_many [| 1.5; 2.5 |] in
+  if Ancient.follow a.(1) <> 2.5 then failwith "mark_many: bad float";
+  Ancient.delete_many a;
+
+  (* Dedup mode copies equal leaves once. *)
+  let t = Array.init 100_000 (fun i -> (string_of_int (i mod 100), i)) in
+  let a, info = Ancient.mark_info ~dedup:true t in
+  let b, plain = Ancient.mark_info t in
+  Ancient.delete b;
+  let t' = Ancient.follow a in
+  Array.iteri (
+    fun i (s, j) ->
+      if s <> string_of_int (i mod 100) || i <> j then
+	failwith (sprintf "dedup: bad element %d" i)
+  ) t';
+  if fst t'.(5) != fst t'.(105) then failwith "dedup: string not shared";
+  if info.Ancient.i_saved = 0 ||
+    info.Ancient.i_size + info.Ancient.i_saved <> plain.Ancient.i_size then
+    failwith "dedup: bad i_saved";
+  Ancient.delete a;
+
+  (* Interned strings are shared between keys. *)
+  let file = Filename.temp_file "test_ancient_mark" ".data" in
+  let fd = Unix.openfile file [Unix.O_RDWR; Unix.O_TRUNC] 0o644 in
+  let md = Ancient.attach fd 0x440000000000n in
+  let a = Ancient.share ~intern:true md 0 [| "foo"; "bar"; "foo" |] in
+  let b, info = Ancient.share_info ~intern:true md 1 ("bar", "baz") in
+  let a' = Ancient.follow a and b' = Ancient.follow b in
+  if a'.(0) != a'.(2) || a'.(1) != fst b' || snd b' <> "baz" then
+    failwith "intern: strings not shared";
+  if info.Ancient.i_saved = 0 then failwith "intern: bad i_saved";
+  let last = ref 0 in
+  ignore (Ancient.warmup ~threads:2 ~progress:(fun d t -> last := t - d) md);
+  if !last <> 0 then failwith "warmup: not finished";
+  Ancient.detach md;
+
+  (* The file may be attached again elsewhere. *)
+  let fd = Unix.openfile file [Unix.O_RDWR] 0 in
+  let md = Ancient.attach ~relocate:true fd 0x450000000000n in
+  let a : string array Ancient.ancient = Ancient.get md 0 in
+  let b : (string * string) Ancient.ancient = Ancient.get md 1 in
+  let a' = Ancient.follow a and b' = Ancient.follow b in
+  if a'.(0) <> "foo" || a'.(1) != fst b' || snd b' <> "baz" then
+    failwith "relocate: bad objects";
+  Ancient.detach md;
+  Unix.unlink file;
+
+  (* Several processes may share into the same file at once. *)
+  let file = Filename.temp_file "test_ancient_mark" ".data" in
+  let fd = Unix.openfile file [Unix.O_RDWR; Unix.O_TRUNC] 0o644 in
+  let md = Ancient.attach fd 0n in
+  let writers = [1; 2; 3; 4] in
+  let pids = List.map (
+    fun w ->
+      match Unix.fork () with
+      | 0 ->
+	  let fd = Unix.openfile file [Unix.O_RDWR] 0 in
+	  let md = Ancient.attach fd 0n in
+	  for k = 0 to 9 do
+	    let a = Array.init 10_000 (fun i -> sprintf "%d.%d.%d" w k i) in
+	    ignore (Ancient.share md w a)
+	  done;
+	  exit 0
+      | pid -> pid
+  ) writers in
+  List.iter (
+    fun pid ->
+      match Unix.waitpid [] pid with
+      | _, Unix.WEXITED 0 -> ()
+      | _ -> failwith "writers: writer failed"
+  ) pids;
+  List.iter (
+    fun w ->
+      let a : string array = Ancient.follow (Ancient.get md w) in
+      if a.(9_999) <> sprintf "%d.9.9999" w then failwith "writers: bad object"
+  ) writers;
+  Ancient.detach md;
+  Unix.unlink file;
+
+  (* Readers see new objects as the file grows, and keep the ones they
+   * got until they release them.
+   *)
+  let file = Filename.temp_file "test_ancient_mark" ".data" in
+  let fd = Unix.openfile file [Unix.O_RDWR; Unix.O_TRUNC] 0o644 in
+  let md = Ancient.attach fd 0n in
+  ignore (Ancient.share md 0 (Array.make 10 "old"));
+  let got_r, got_w = Unix.pipe () and shared_r, shared_w = Unix.pipe () in
+  let pid =
+    match Unix.fork () with
+    | 0 ->
+	let fd = Unix.openfile file [Unix.O_RDONLY] 0 in
+	let md = Ancient.attach_readonly fd in
+	let old : string array = Ancient.follow (Ancient.get md 0) in
+	ignore (Unix.write_substring got_w "x" 0 1);
+	ignore (Unix.read shared_r (Bytes.create 1) 0 1);
+	if old.(9) <> "old" then exit 1;
+	Ancient.release md;
+	let a : string array = Ancient.follow (Ancient.get md 0) in
+	if a.(999_999) <> "999999" then exit 2;
+	Ancient.detach md;
+	exit 0
+    | pid -> pid in
+  ignore (Unix.read got_r (Bytes.create 1) 0 1);
+  ignore (Ancient.share md 0 (Array.init 1_000_000 string_of_int));
+  ignore (Unix.write_substring shared_w "x" 0 1);
+  (match Unix.waitpid [] pid with
+   | _, Unix.WEXITED 0 -> ()
+   | _ -> failwith "versions: reader failed");
+  List.iter Unix.close [got_r; got_w; shared_r; shared_w];
+  Ancient.detach md;
+  Unix.unlink file;
+
+  (* The space of replaced objects of many sizes is reused. *)
+  let file = Filename.temp_file "test_ancient_mark" ".data" in
+  let fd = Unix.openfile file [Unix.O_RDWR; Unix.O_TRUNC] 0o644 in
+  let md = Ancient.attach fd 0n in
+  let round r =
+    for k = 0 to 99 do
+      let n = 100 + (k * 7919 + r * 104_729) mod 5_000 in
+      ignore (Ancient.share md k (Array.make n (r, k)))
+    done in
+  round 0;
+  let size = (Unix.fstat fd).Unix.st_size in
+  for r = 1 to 20 do round r done;
+  for k = 0 to 99 do
+    let a : (int * int) array = Ancient.follow (Ancient.get md k) in
+    if a.(0) <> (20, k) then failwith "reuse: bad object"
+  done;
+  if (Unix.fstat fd).Unix.st_size > 4 * size then
+    failwith "reuse: file keeps growing";
+  Ancient.detach md;
+  Unix.unlink file;
+
+  (* Layouts and alignment only change where the objects go. *)
+  let module M = Map.Make (String) in
+  let m = ref M.empty in
+  for i = 0 to 99_999 do m := M.add (string_of_int i) (Array.make 20 i) !m done;
+  List.iter (
+    fun (layout, align) ->
+      let a = Ancient.mark ~layout ~align !m in
+      let m' = Ancient.follow a in
+      for i = 0 to 99_999 do
+	let arr = M.find (string_of_int i) m' in
+	if arr.(19) <> i then failwith (sprintf "layout: bad element %d" i);
+	if align &&
+	  Nativeint.rem (Ancient.address_of arr) 64n <> 0n then
+	  failwith "layout: array not aligned"
+      done;
+      Ancient.delete a
+  ) [ Ancient.Depth_first, true; Ancient.Breadth_first, false;
+      Ancient.Clustered, false; Ancient.Clustered, true ];
+
+  (* Large copies with huge pages start on a 2 MB boundary. *)
+  let a = Ancient.mark ~hugepages:true (Array.init 500_000 string_of_int) in
+  let arr = Ancient.follow a in
+  if arr.(499_999) <> "499999" then failwith "hugepages: bad element";
+  let start = Nativeint.sub (Ancient.address_of arr) 8n in
+  if Nativeint.rem start 0x200000n <> 0n then
+    failwith "hugepages: copy not aligned";
+  Ancient.delete a;
+
+  (* Garbage collect - good way to check we haven't broken anything. *)
+  Gc.compact ();
+
+  printf "Mark test succeeded.\n"